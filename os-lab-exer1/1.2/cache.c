@@ -0,0 +1,291 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "concat.h"
+
+/* the page cache is given back in ranges of this size */
+#define CACHE_CHUNK (8 << 20)
+/* O_DIRECT buffer, offset and length alignment */
+#define DIRECT_ALIGN 4096
+#define DIRECT_BUFF_SIZE (4 << 20)
+
+/*
+ * Output writeback is started for the newest range and waited for on the
+ * previous one, then its pages are dropped; the disk keeps busy while the
+ * cache footprint stays at about two ranges.
+ */
+struct drop_behind
+{
+    int fd;
+    off_t kicked;  /* writeback started up to here */
+    off_t dropped; /* pages dropped up to here */
+};
+
+static void drop_behind_advance(struct drop_behind *d, off_t pos,
+                                struct copy_stats *st)
+{
+    if (pos - d->kicked < CACHE_CHUNK)
+        return;
+    sync_file_range(d->fd, d->kicked, pos - d->kicked, SYNC_FILE_RANGE_WRITE);
+    if (d->kicked > d->dropped)
+    {
+        sync_file_range(d->fd, d->dropped, d->kicked - d->dropped,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                            SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(d->fd, d->dropped, d->kicked - d->dropped,
+                      POSIX_FADV_DONTNEED);
+        st->syscalls += 2;
+        d->dropped = d->kicked;
+    }
+    st->syscalls++;
+    d->kicked = pos;
+}
+
+static void drop_behind_finish(struct drop_behind *d, off_t pos,
+                               struct copy_stats *st)
+{
+    if (pos > d->dropped)
+    {
+        sync_file_range(d->fd, d->dropped, pos - d->dropped,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                            SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(d->fd, d->dropped, pos - d->dropped,
+                      POSIX_FADV_DONTNEED);
+        st->syscalls += 2;
+    }
+    d->kicked = d->dropped = pos;
+}
+
+void copy_nocache(int fd_out, int fd_in, const struct stat *sin,
+                  struct copy_stats *st)
+{
+    size_t size = rw_buffer_size(sin);
+    char *buff = rw_buffer(size);
+    struct drop_behind out;
+    off_t in_pos = 0, in_dropped = 0, out_pos;
+    ssize_t rcnt;
+
+    /* a pipe or a terminal has no offsets, the sync/fadvise calls just fail */
+    out_pos = lseek(fd_out, 0, SEEK_CUR);
+    if (out_pos == -1)
+        out_pos = 0;
+    out.fd = fd_out;
+    out.kicked = out.dropped = out_pos;
+    posix_fadvise(fd_in, 0, 0, POSIX_FADV_SEQUENTIAL);
+    st->syscalls += 2;
+
+    for (;;)
+    {
+        rcnt = read(fd_in, buff, size);
+        st->syscalls++;
+        if (rcnt == 0)
+            break;
+        if (rcnt == -1)
+        {
+            perror("read");
+            exit(1);
+        }
+        crc_account(st, buff, rcnt);
+        doWrite(fd_out, buff, rcnt);
+        st->syscalls++;
+        st->bytes += rcnt;
+        in_pos += rcnt;
+        out_pos += rcnt;
+
+        /* input pages are clean, they can go as soon as they are written */
+        if (in_pos - in_dropped >= CACHE_CHUNK)
+        {
+            posix_fadvise(fd_in, in_dropped, in_pos - in_dropped,
+                          POSIX_FADV_DONTNEED);
+            st->syscalls++;
+            in_dropped = in_pos;
+        }
+        drop_behind_advance(&out, out_pos, st);
+    }
+    posix_fadvise(fd_in, in_dropped, 0, POSIX_FADV_DONTNEED);
+    drop_behind_finish(&out, out_pos, st);
+    st->syscalls++;
+    st->path = PATH_NOCACHE;
+}
+
+static int set_direct(int fd, int on)
+{
+    int flags = fcntl(fd, F_GETFL);
+
+    if (flags == -1)
+        return -1;
+    flags = on ? flags | O_DIRECT : flags & ~O_DIRECT;
+    return fcntl(fd, F_SETFL, flags);
+}
+
+/* writes len bytes, dropping O_DIRECT if the output turns out not to take it */
+static void direct_write(int fd_out, const char *buff, size_t len,
+                         int *direct)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+        n = write(fd_out, buff, len);
+        if (n == -1 && errno == EINVAL && *direct)
+        {
+            fprintf(stderr, "O_DIRECT refused by the output, "
+                            "writing through the page cache\n");
+            set_direct(fd_out, 0);
+            *direct = 0;
+            continue;
+        }
+        if (n == -1)
+        {
+            perror("write");
+            exit(1);
+        }
+        buff += n;
+        len -= n;
+    }
+}
+
+/*
+ * O_DIRECT wants aligned buffers, offsets and lengths. The output is
+ * staged in an aligned buffer and written in whole blocks; the few bytes
+ * past the last block boundary wait for the next input, and the very last
+ * ones are written with O_DIRECT turned off.
+ */
+void concat_direct(int fd_out, char **infiles, int cnt, struct copy_stats *st)
+{
+    char *wbuff, *rbuff;
+    size_t carry = 0;
+    int out_direct;
+
+    if (posix_memalign((void **)&wbuff, DIRECT_ALIGN, DIRECT_BUFF_SIZE) ||
+        posix_memalign((void **)&rbuff, DIRECT_ALIGN, DIRECT_BUFF_SIZE))
+    {
+        perror("posix_memalign");
+        exit(1);
+    }
+    out_direct = set_direct(fd_out, 1) == 0;
+
+    for (int i = 0; i < cnt; ++i)
+    {
+        int in_direct = 1;
+        int fd_in = open(infiles[i], O_RDONLY | O_DIRECT);
+
+        if (fd_in == -1 && errno == EINVAL)
+        {
+            /* filesystem without O_DIRECT: drop what we read instead */
+            in_direct = 0;
+            fd_in = open(infiles[i], O_RDONLY);
+        }
+        if (fd_in == -1)
+        {
+            perror("open error");
+            exit(1);
+        }
+        st[i].syscalls += 2; /* open/close */
+        st[i].path = in_direct ? PATH_DIRECT : PATH_NOCACHE;
+
+        for (;;)
+        {
+            /* read straight into the staging buffer while it is aligned */
+            int aligned = carry % DIRECT_ALIGN == 0;
+            char *dst = aligned ? wbuff + carry : rbuff;
+            size_t want = (DIRECT_BUFF_SIZE - carry) / DIRECT_ALIGN * DIRECT_ALIGN;
+            ssize_t rcnt = read(fd_in, dst, want);
+
+            st[i].syscalls++;
+            if (rcnt == -1 && errno == EINVAL && in_direct)
+            {
+                /* O_DIRECT accepted by open() but not by read() */
+                set_direct(fd_in, 0);
+                in_direct = 0;
+                st[i].path = PATH_NOCACHE;
+                continue;
+            }
+            if (rcnt == -1)
+            {
+                perror("read");
+                exit(1);
+            }
+            if (rcnt == 0)
+                break;
+            crc_account(&st[i], dst, rcnt);
+            if (!aligned)
+                memcpy(wbuff + carry, rbuff, rcnt);
+            carry += rcnt;
+            st[i].bytes += rcnt;
+
+            size_t whole = carry / DIRECT_ALIGN * DIRECT_ALIGN;
+            if (whole > 0)
+            {
+                direct_write(fd_out, wbuff, whole, &out_direct);
+                st[i].syscalls++;
+                memmove(wbuff, wbuff + whole, carry - whole);
+                carry -= whole;
+            }
+        }
+        if (!in_direct)
+        {
+            posix_fadvise(fd_in, 0, 0, POSIX_FADV_DONTNEED);
+            st[i].syscalls++;
+        }
+        close(fd_in);
+    }
+
+    /* the unaligned tail goes through the page cache, then leaves it */
+    if (out_direct)
+        set_direct(fd_out, 0);
+    if (carry > 0)
+        doWrite(fd_out, wbuff, carry);
+    fdatasync(fd_out);
+    posix_fadvise(fd_out, 0, 0, POSIX_FADV_DONTNEED);
+    if (cnt > 0)
+        st[cnt - 1].syscalls += 4;
+    free(rbuff);
+    free(wbuff);
+}
+
+/* bytes of the file that currently sit in the page cache, -1 if unknown */
+off_t page_cache_bytes(const char *path)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    struct stat sb;
+    unsigned char *vec;
+    off_t resident = 0;
+    void *map;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+    if (fstat(fd, &sb) == -1 || !S_ISREG(sb.st_mode))
+    {
+        close(fd);
+        return -1;
+    }
+    if (sb.st_size == 0)
+    {
+        close(fd);
+        return 0;
+    }
+    map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+    vec = malloc((sb.st_size + page - 1) / page);
+    if (vec != NULL && mincore(map, sb.st_size, vec) == 0)
+    {
+        for (off_t p = 0; p < (sb.st_size + page - 1) / page; ++p)
+            resident += vec[p] & 1;
+    }
+    free(vec);
+    munmap(map, sb.st_size);
+    return resident * page;
+}
@@ -0,0 +1,235 @@
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "concat.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+/* CRC-32C (Castagnoli), reflected */
+#define CRC32C_POLY 0x82f63b78
+
+#define MANIFEST_LINE 4096
+
+int crc_enabled;
+
+static uint32_t crc_table[256];
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+    while (len--)
+        crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+/* the SSE4.2 crc32 instruction, eight bytes at a time */
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+    uint64_t c = crc;
+
+    while (len > 0 && ((uintptr_t)p & 7))
+    {
+        c = _mm_crc32_u8(c, *p++);
+        len--;
+    }
+    while (len >= 8)
+    {
+        uint64_t w;
+
+        memcpy(&w, p, 8);
+        c = _mm_crc32_u64(c, w);
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+        c = _mm_crc32_u8(c, *p++);
+    return c;
+}
+#endif
+
+static uint32_t (*crc32c_impl)(uint32_t, const unsigned char *, size_t);
+
+static void crc32c_init(void)
+{
+    for (uint32_t i = 0; i < 256; ++i)
+    {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k)
+            c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        crc_table[i] = c;
+    }
+    crc32c_impl = crc32c_sw;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+        crc32c_impl = crc32c_hw;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buff, size_t len)
+{
+    if (crc32c_impl == NULL)
+        crc32c_init();
+    return ~crc32c_impl(~crc, buff, len);
+}
+
+static uint32_t gf2_times(const uint32_t *mat, uint32_t vec)
+{
+    uint32_t sum = 0;
+
+    for (; vec; vec >>= 1, mat++)
+        if (vec & 1)
+            sum ^= *mat;
+    return sum;
+}
+
+static void gf2_square(uint32_t *square, const uint32_t *mat)
+{
+    for (int n = 0; n < 32; ++n)
+        square[n] = gf2_times(mat, mat[n]);
+}
+
+/*
+ * The CRC of A followed by B, from crc(A), crc(B) and the length of B:
+ * crc(A) is pushed through len2 zero bytes by repeated squaring of the
+ * one-zero-bit operator, as zlib's crc32_combine() does.
+ */
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, off_t len2)
+{
+    uint32_t even[32], odd[32], row = 1;
+
+    if (len2 <= 0)
+        return crc1;
+    odd[0] = CRC32C_POLY;
+    for (int n = 1; n < 32; ++n)
+    {
+        odd[n] = row;
+        row <<= 1;
+    }
+    gf2_square(even, odd); /* two zero bits */
+    gf2_square(odd, even); /* four zero bits */
+    do
+    {
+        gf2_square(even, odd);
+        if (len2 & 1)
+            crc1 = gf2_times(even, crc1);
+        len2 >>= 1;
+        if (len2 == 0)
+            break;
+        gf2_square(odd, even);
+        if (len2 & 1)
+            crc1 = gf2_times(odd, crc1);
+        len2 >>= 1;
+    } while (len2 != 0);
+    return crc1 ^ crc2;
+}
+
+void crc_account(struct copy_stats *st, const void *buff, size_t len)
+{
+    if (crc_enabled)
+        st->crc = crc32c(st->crc, buff, len);
+}
+
+uint32_t output_crc(const struct copy_stats *st, int cnt)
+{
+    uint32_t crc = 0;
+
+    for (int i = 0; i < cnt; ++i)
+        crc = crc32c_combine(crc, st[i].crc, st[i].bytes);
+    return crc;
+}
+
+void write_manifest(const char *path, char **names,
+                    const struct copy_stats *st, int cnt, const char *outfile)
+{
+    off_t total = 0;
+    FILE *fp;
+
+    fp = fopen(path, "w");
+    if (fp == NULL)
+    {
+        perror(path);
+        exit(1);
+    }
+    fprintf(fp, "# crc32c bytes name, the inputs in order, then the output\n");
+    for (int i = 0; i < cnt; ++i)
+    {
+        fprintf(fp, "%08x %lld %s\n", st[i].crc, (long long)st[i].bytes,
+                names[i]);
+        total += st[i].bytes;
+    }
+    fprintf(fp, "%08x %lld %s\n", output_crc(st, cnt), (long long)total,
+            outfile);
+    if (fclose(fp) == EOF)
+    {
+        perror(path);
+        exit(1);
+    }
+}
+
+/* compares one manifest line with what was just copied */
+static int verify_line(const char *line, const char *name, uint32_t crc,
+                       off_t bytes)
+{
+    unsigned old_crc;
+    long long old_bytes;
+
+    if (sscanf(line, "%8x %lld", &old_crc, &old_bytes) != 2)
+    {
+        fprintf(stderr, "%s: malformed manifest line: %s", name, line);
+        return 1;
+    }
+    if (old_crc != crc || old_bytes != bytes)
+    {
+        fprintf(stderr, "%s: MISMATCH, crc32c %08x, %lld bytes, expected "
+                        "%08x, %lld bytes\n",
+                name, crc, (long long)bytes, old_crc, old_bytes);
+        return 1;
+    }
+    return 0;
+}
+
+int verify_manifest(const char *path, char **names,
+                    const struct copy_stats *st, int cnt, const char *outfile)
+{
+    char line[MANIFEST_LINE];
+    off_t total = 0;
+    int i = 0, bad = 0;
+    FILE *fp;
+
+    fp = fopen(path, "r");
+    if (fp == NULL)
+    {
+        perror(path);
+        exit(1);
+    }
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        if (i < cnt)
+        {
+            bad += verify_line(line, names[i], st[i].crc, st[i].bytes);
+            total += st[i].bytes;
+        }
+        else if (i == cnt)
+        {
+            bad += verify_line(line, outfile, output_crc(st, cnt), total);
+        }
+        i++;
+    }
+    fclose(fp);
+    if (i != cnt + 1)
+    {
+        fprintf(stderr, "%s: lists %d files, expected %d inputs and the "
+                        "output\n",
+                path, i, cnt);
+        bad++;
+    }
+    return bad;
+}
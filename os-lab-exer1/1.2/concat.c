@@ -0,0 +1,652 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "concat.h"
+
+/* bytes handed to the kernel by a single copy_file_range/sendfile/splice */
+#define KERNEL_CHUNK (1 << 30)
+
+/* upper bound of the read/write buffer, whatever the input size */
+#define RW_BUFF_MAX (1 << 20)
+
+/* bytes of an input mapped at a time by -m mmap */
+#define MMAP_WINDOW (64 << 20)
+
+/* pipe size asked for an extra output that is a pipe */
+#define FANOUT_PIPE_SIZE (1 << 20)
+
+/* buffer size forced with -b, 0 to pick one per input */
+static size_t rw_fixed;
+
+/* the read/write buffer, shared by all inputs and grown on demand */
+static char *rw_buff;
+static size_t rw_size;
+
+void doWrite(int fd, const char *buff, size_t len)
+{
+    size_t idx = 0;
+    ssize_t wcount = 0;
+    do
+    {
+        wcount = write(fd, buff + idx, len - idx);
+        if (wcount == -1)
+        { /* error */
+            perror("write");
+            exit(1);
+        }
+        idx += wcount;
+    } while (idx < len);
+}
+
+/*
+ * Small inputs are read with a single call, everything else in
+ * RW_BUFF_MAX pieces, always in whole st_blksize blocks.
+ */
+size_t rw_buffer_size(const struct stat *sin)
+{
+    size_t blk = sin->st_blksize > 0 ? sin->st_blksize : 4096;
+    size_t want = RW_BUFF_MAX;
+
+    if (rw_fixed)
+        return rw_fixed;
+    if (S_ISREG(sin->st_mode) && sin->st_size < RW_BUFF_MAX)
+        want = sin->st_size + 1; /* +1 so that EOF is seen by the same read */
+    return (want + blk - 1) / blk * blk;
+}
+
+char *rw_buffer(size_t size)
+{
+    if (size > rw_size)
+    {
+        free(rw_buff);
+        rw_buff = malloc(size);
+        if (rw_buff == NULL)
+        {
+            perror("malloc");
+            exit(1);
+        }
+        rw_size = size;
+    }
+    return rw_buff;
+}
+
+static void copy_rw(int fd_out, int fd_in, const struct stat *sin,
+                    struct copy_stats *st)
+{
+    size_t size = rw_buffer_size(sin);
+    char *buff = rw_buffer(size);
+    ssize_t rcnt = 0;
+
+    for (;;)
+    {
+        rcnt = read(fd_in, buff, size);
+        st->syscalls++;
+        if (rcnt == 0)
+            break;
+        if (rcnt == -1)
+        { /* error */
+            perror("read");
+            exit(1);
+        }
+        crc_account(st, buff, rcnt);
+        doWrite(fd_out, buff, rcnt);
+        st->syscalls++;
+        st->bytes += rcnt;
+    }
+}
+
+/*
+ * Writes the input straight from a window of its mapping. Only one window
+ * is mapped at a time, so huge inputs do not pin huge amounts of memory;
+ * the kernel is told to read the next window ahead while this one is written.
+ */
+static void copy_mmap(int fd_out, int fd_in, const struct stat *sin,
+                      struct copy_stats *st)
+{
+    off_t off;
+    size_t len;
+    char *map;
+
+    for (off = 0; off < sin->st_size; off += len)
+    {
+        len = sin->st_size - off < MMAP_WINDOW ? sin->st_size - off
+                                               : MMAP_WINDOW;
+        map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd_in, off);
+        if (map == MAP_FAILED)
+        {
+            perror("mmap");
+            exit(1);
+        }
+        madvise(map, len, MADV_SEQUENTIAL);
+        madvise(map, len, MADV_WILLNEED);
+        if (off + len < sin->st_size)
+        {
+            /* readahead for the next window, through the page cache */
+            posix_fadvise(fd_in, off + len, MMAP_WINDOW, POSIX_FADV_WILLNEED);
+            st->syscalls++;
+        }
+        crc_account(st, map, len);
+        doWrite(fd_out, map, len);
+        munmap(map, len);
+        st->syscalls += 5;
+        st->bytes += len;
+    }
+    st->path = PATH_MMAP;
+}
+
+/*
+ * These errors mean "this path does not work for this pair of
+ * descriptors" (old kernel, cross-filesystem, O_APPEND output, ...),
+ * as long as nothing has been copied yet.
+ */
+static int path_unsupported(int err)
+{
+    return err == ENOSYS || err == EXDEV || err == EINVAL ||
+           err == EOPNOTSUPP || err == EBADF;
+}
+
+/*
+ * Runs one of the kernel-side paths until EOF.
+ * Returns 0 on success, -1 if the path is not usable and nothing was copied.
+ */
+static int copy_kernel(int fd_out, int fd_in, enum copy_path path,
+                       struct copy_stats *st)
+{
+    ssize_t n;
+
+    for (;;)
+    {
+        switch (path)
+        {
+        case PATH_COPY_RANGE:
+            n = copy_file_range(fd_in, NULL, fd_out, NULL, KERNEL_CHUNK, 0);
+            break;
+        case PATH_SENDFILE:
+            n = sendfile(fd_out, fd_in, NULL, KERNEL_CHUNK);
+            break;
+        case PATH_SPLICE:
+            n = splice(fd_in, NULL, fd_out, NULL, KERNEL_CHUNK,
+                       SPLICE_F_MOVE | SPLICE_F_MORE);
+            break;
+        default:
+            return -1;
+        }
+        st->syscalls++;
+        if (n == 0)
+            break;
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (st->bytes == 0 && path_unsupported(errno))
+                return -1;
+            perror(copy_path_name(path));
+            exit(1);
+        }
+        st->bytes += n;
+    }
+    st->path = path;
+    return 0;
+}
+
+void copy_range(int fd_out, int fd_in, off_t in_off, off_t out_off,
+                off_t len, struct copy_stats *st)
+{
+    ssize_t n;
+    int kernel = 1;
+
+    while (len > 0)
+    {
+        if (kernel)
+        {
+            n = copy_file_range(fd_in, &in_off, fd_out, &out_off, len, 0);
+            st->syscalls++;
+            if (n == -1 && path_unsupported(errno))
+            {
+                kernel = 0;
+                continue;
+            }
+        }
+        else
+        {
+            size_t want = len < RW_BUFF_MAX ? len : RW_BUFF_MAX;
+            char *buff = rw_buffer(want);
+
+            n = pread(fd_in, buff, want, in_off);
+            st->syscalls++;
+            if (n > 0)
+            {
+                if (pwrite(fd_out, buff, n, out_off) != n)
+                    n = -1;
+                st->syscalls++;
+            }
+            if (n > 0)
+            {
+                in_off += n;
+                out_off += n;
+            }
+        }
+        if (n == -1)
+        {
+            perror("copy");
+            exit(1);
+        }
+        if (n == 0)
+        {
+            /* the missing tail would be left as zeros in the output */
+            fprintf(stderr, "input shrank while copying\n");
+            exit(1);
+        }
+        len -= n;
+        st->bytes += n;
+    }
+}
+
+/*
+ * Only the data extents of a sparse input are copied; the output is
+ * seeked over the holes, so they stay holes there too. Returns -1 if the
+ * output cannot seek.
+ */
+static int copy_sparse(int fd_out, int fd_in, const struct stat *sin,
+                       struct copy_stats *st)
+{
+    off_t base, data, hole = 0;
+    struct stat sout;
+
+    base = lseek(fd_out, 0, SEEK_CUR);
+    if (base == -1)
+        return -1;
+    for (;;)
+    {
+        data = lseek(fd_in, hole, SEEK_DATA);
+        st->syscalls++;
+        if (data == -1 && errno == ENXIO)
+            break; /* nothing but holes up to EOF */
+        if (data == -1 && hole == 0)
+            return -1; /* no SEEK_DATA here, nothing copied yet */
+        if (data == -1)
+        {
+            perror("SEEK_DATA");
+            exit(1);
+        }
+        hole = lseek(fd_in, data, SEEK_HOLE);
+        st->syscalls++;
+        if (hole == -1)
+        {
+            perror("SEEK_HOLE");
+            exit(1);
+        }
+        copy_range(fd_out, fd_in, data, base + data, hole - data, st);
+    }
+    /* a trailing hole has no data to extend the output, do it by hand */
+    if (fstat(fd_out, &sout) == 0 && sout.st_size < base + sin->st_size &&
+        ftruncate(fd_out, base + sin->st_size) == -1)
+    {
+        perror("ftruncate");
+        exit(1);
+    }
+    lseek(fd_out, base + sin->st_size, SEEK_SET);
+    st->syscalls += 3;
+    st->holes = sin->st_size - st->bytes;
+    st->bytes = sin->st_size;
+    st->path = PATH_SPARSE;
+    return 0;
+}
+
+void copy_fd(int fd_out, int fd_in, enum copy_mode mode, struct copy_stats *st)
+{
+    struct stat sin, sout;
+
+    if (fstat(fd_in, &sin) == -1)
+    {
+        perror("fstat");
+        exit(1);
+    }
+    st->syscalls++;
+    st->path = PATH_RW;
+    if (mode == MODE_MMAP && S_ISREG(sin.st_mode))
+    {
+        copy_mmap(fd_out, fd_in, &sin, st);
+        return;
+    }
+    if (mode == MODE_NOCACHE)
+    {
+        copy_nocache(fd_out, fd_in, &sin, st);
+        return;
+    }
+    /* the kernel-side paths never show us the bytes to checksum */
+    if (mode == MODE_AUTO && !crc_enabled && fstat(fd_out, &sout) == 0)
+    {
+        st->syscalls++;
+        if (S_ISFIFO(sin.st_mode) || S_ISFIFO(sout.st_mode))
+        {
+            if (copy_kernel(fd_out, fd_in, PATH_SPLICE, st) == 0)
+                return;
+        }
+        else if (S_ISREG(sin.st_mode))
+        {
+            /* fewer blocks than the size says: there are holes to keep */
+            if (S_ISREG(sout.st_mode) &&
+                (off_t)sin.st_blocks * 512 < sin.st_size &&
+                copy_sparse(fd_out, fd_in, &sin, st) == 0)
+                return;
+            if (S_ISREG(sout.st_mode) &&
+                copy_kernel(fd_out, fd_in, PATH_COPY_RANGE, st) == 0)
+                return;
+            if (copy_kernel(fd_out, fd_in, PATH_SENDFILE, st) == 0)
+                return;
+        }
+    }
+    copy_rw(fd_out, fd_in, &sin, st);
+}
+
+void write_file(int fd_out, const char *infile, enum copy_mode mode,
+                struct copy_stats *st)
+{
+    int fd3;
+
+    fd3 = open(infile, O_RDONLY);
+    if (fd3 == -1)
+    {
+        perror("open error");
+        exit(1);
+    }
+    copy_fd(fd_out, fd3, mode, st);
+    close(fd3);
+    st->syscalls += 2; /* open/close */
+}
+
+void concat_files(int fd_out, char **infiles, int cnt,
+                  const struct concat_opts *opts, struct copy_stats *st)
+{
+    rw_fixed = opts->buff_size;
+    crc_enabled = opts->checksum;
+    if (crc_enabled && (opts->mode == MODE_URING || opts->nr_threads > 0))
+    {
+        /* completions come back out of order, there is no running CRC */
+        fprintf(stderr, "checksums need an in-order copy, "
+                        "falling back to read/write\n");
+        for (int i = 0; i < cnt; ++i)
+            write_file(fd_out, infiles[i], MODE_RW, &st[i]);
+    }
+    else if (opts->mode == MODE_URING)
+    {
+        if (concat_uring(fd_out, infiles, cnt, opts->depth, st) == 0)
+            return;
+        fprintf(stderr, "io_uring not usable for these files, "
+                        "falling back to read/write\n");
+        for (int i = 0; i < cnt; ++i)
+            write_file(fd_out, infiles[i], MODE_RW, &st[i]);
+    }
+    else if (opts->mode == MODE_PIPELINE)
+    {
+        concat_pipeline(fd_out, infiles, cnt, opts->depth, opts->buff_size, st);
+    }
+    else if (opts->mode == MODE_DIRECT)
+    {
+        concat_direct(fd_out, infiles, cnt, st);
+    }
+    else if (opts->mode == MODE_GATHER)
+    {
+        concat_gather(fd_out, infiles, cnt, st);
+    }
+    else if (opts->nr_threads > 0)
+    {
+        int nr_chunks = concat_parallel(fd_out, infiles, cnt,
+                                        opts->nr_threads, opts->mode, st);
+        if (opts->verbose)
+            fprintf(stderr, "parallel: %d threads, %d chunks\n",
+                    opts->nr_threads, nr_chunks);
+    }
+    else
+    {
+        for (int i = 0; i < cnt; ++i)
+            write_file(fd_out, infiles[i], opts->mode, &st[i]);
+    }
+}
+
+void fan_out(const char *outfile, char **extras, int nr, int verbose)
+{
+    int saved_crc = crc_enabled;
+    struct stat sout;
+
+    if (nr == 0)
+        return;
+    if (stat(outfile, &sout) == -1 || !S_ISREG(sout.st_mode))
+    {
+        fprintf(stderr, "%s: extra outputs are copied from the first one, "
+                        "which has to be a regular file\n",
+                outfile);
+        exit(1);
+    }
+    /* the output is already summed, the kernel paths may be used again */
+    crc_enabled = 0;
+    for (int k = 0; k < nr; ++k)
+    {
+        struct copy_stats st;
+        int fd;
+
+        memset(&st, 0, sizeof(st));
+        if (!strcmp(extras[k], "-"))
+            fd = STDOUT_FILENO;
+        else
+            fd = open(extras[k], O_CREAT | O_WRONLY | O_TRUNC,
+                      S_IRUSR | S_IWUSR);
+        if (fd == -1)
+        {
+            perror(extras[k]);
+            exit(1);
+        }
+        /* a bigger pipe means fewer splice() calls, if we may have one */
+        if (fstat(fd, &sout) == 0 && S_ISFIFO(sout.st_mode) &&
+            fcntl(fd, F_SETPIPE_SZ, FANOUT_PIPE_SIZE) != -1)
+            st.syscalls++;
+        st.syscalls++;
+        write_file(fd, outfile, MODE_AUTO, &st);
+        if (fd != STDOUT_FILENO)
+            close(fd);
+        if (verbose)
+            fprintf(stderr, "%s: %lld bytes via %s (%lu syscalls)\n",
+                    extras[k], (long long)st.bytes, copy_path_name(st.path),
+                    st.syscalls);
+    }
+    crc_enabled = saved_crc;
+}
+
+const char *copy_path_name(enum copy_path path)
+{
+    switch (path)
+    {
+    case PATH_RW:
+        return "read/write";
+    case PATH_COPY_RANGE:
+        return "copy_file_range";
+    case PATH_SENDFILE:
+        return "sendfile";
+    case PATH_SPLICE:
+        return "splice";
+    case PATH_URING:
+        return "io_uring";
+    case PATH_MMAP:
+        return "mmap";
+    case PATH_GATHER:
+        return "writev";
+    case PATH_PIPELINE:
+        return "pipeline";
+    case PATH_DIRECT:
+        return "O_DIRECT";
+    case PATH_NOCACHE:
+        return "read/write+DONTNEED";
+    case PATH_SPARSE:
+        return "sparse copy_file_range";
+    case PATH_RESUMED:
+        return "an earlier run";
+    }
+    return "unknown";
+}
+
+int parse_copy_mode(const char *name, enum copy_mode *mode)
+{
+    if (!strcmp(name, "auto"))
+        *mode = MODE_AUTO;
+    else if (!strcmp(name, "rw"))
+        *mode = MODE_RW;
+    else if (!strcmp(name, "uring"))
+        *mode = MODE_URING;
+    else if (!strcmp(name, "mmap"))
+        *mode = MODE_MMAP;
+    else if (!strcmp(name, "gather"))
+        *mode = MODE_GATHER;
+    else if (!strcmp(name, "pipeline"))
+        *mode = MODE_PIPELINE;
+    else if (!strcmp(name, "direct"))
+        *mode = MODE_DIRECT;
+    else if (!strcmp(name, "nocache"))
+        *mode = MODE_NOCACHE;
+    else
+        return -1;
+    return 0;
+}
+
+void concat_usage(const char *synopsis)
+{
+    fprintf(stderr, "%s", synopsis);
+    fprintf(stderr, "  -m mode     copy strategy: auto (default), rw, uring, mmap, "
+                    "gather,\n"
+                    "              pipeline, direct or nocache\n"
+                    "  -j threads  parallel positional copy, with -m auto or rw\n"
+                    "  -q depth    requests in flight (uring), buffers (pipeline)\n"
+                    "  -b bytes    read/write buffer size\n"
+                    "  -o output   also write the result to output (- for stdout),\n"
+                    "              copied in the kernel from the first output\n"
+                    "  -J          resumable: journal the progress, rename when "
+                    "done\n"
+                    "  -v          report bytes, syscalls and paths\n"
+                    "  -c manifest write the CRC32C of the inputs and output\n"
+                    "  -C manifest check the CRC32Cs against an earlier manifest\n");
+    exit(1);
+}
+
+int parse_concat_opts(int argc, char **argv, const char *synopsis,
+                      struct concat_opts *opts)
+{
+    int opt;
+
+    memset(opts, 0, sizeof(*opts));
+    opts->mode = MODE_AUTO;
+    opts->depth = 16;
+    opts->extras = malloc(argc * sizeof(*opts->extras));
+    if (opts->extras == NULL)
+    {
+        perror("malloc");
+        exit(1);
+    }
+    while ((opt = getopt(argc, argv, "m:j:q:b:vc:C:o:J")) != -1)
+    {
+        switch (opt)
+        {
+        case 'm':
+            if (parse_copy_mode(optarg, &opts->mode) == -1)
+                concat_usage(synopsis);
+            break;
+        case 'j':
+            opts->nr_threads = atoi(optarg);
+            if (opts->nr_threads <= 0)
+                concat_usage(synopsis);
+            break;
+        case 'q':
+            opts->depth = atoi(optarg);
+            if (opts->depth <= 0)
+                concat_usage(synopsis);
+            break;
+        case 'b':
+            opts->buff_size = strtoul(optarg, NULL, 10);
+            if (opts->buff_size == 0)
+                concat_usage(synopsis);
+            break;
+        case 'o':
+            opts->extras[opts->nr_extras++] = optarg;
+            break;
+        case 'J':
+            opts->journal = 1;
+            break;
+        case 'v':
+            opts->verbose = 1;
+            break;
+        case 'c':
+            opts->manifest = optarg;
+            opts->checksum = 1;
+            break;
+        case 'C':
+            opts->verify = optarg;
+            opts->checksum = 1;
+            break;
+        default:
+            concat_usage(synopsis);
+        }
+    }
+    /* a resumed run only sees part of the bytes */
+    if (opts->journal && opts->checksum)
+        concat_usage(synopsis);
+    /* concat_parallel() copies with copy_file_range() or pread()/pwrite() */
+    if (opts->nr_threads > 0 && opts->mode != MODE_AUTO &&
+        opts->mode != MODE_RW)
+    {
+        fprintf(stderr, "-j works with -m auto or rw only\n");
+        concat_usage(synopsis);
+    }
+    return optind;
+}
+
+void print_report(char **names, const struct copy_stats *st, int cnt,
+                  const char *outfile, double secs)
+{
+    off_t total = 0, resumed = 0, in_cached = 0, out_cached, cached;
+    unsigned long calls = 0;
+
+    for (int i = 0; i < cnt; ++i)
+    {
+        fprintf(stderr, "%s: %lld bytes via %s (%lu syscalls)", names[i],
+                (long long)st[i].bytes, copy_path_name(st[i].path),
+                st[i].syscalls);
+        if (st[i].holes > 0)
+            fprintf(stderr, ", %lld bytes of holes kept",
+                    (long long)st[i].holes);
+        if (st[i].resumed > 0 && st[i].path != PATH_RESUMED)
+            fprintf(stderr, ", %lld bytes of it from an earlier run",
+                    (long long)st[i].resumed);
+        if (crc_enabled)
+            fprintf(stderr, ", crc32c %08x", st[i].crc);
+        fprintf(stderr, "\n");
+        total += st[i].bytes;
+        resumed += st[i].resumed;
+        calls += st[i].syscalls;
+        cached = page_cache_bytes(names[i]);
+        if (cached > 0)
+            in_cached += cached;
+    }
+    fprintf(stderr, "total: %lld bytes, %lu syscalls, %.3f s", (long long)total,
+            calls, secs);
+    /* the rate of this run, without what an earlier one had copied */
+    if (secs > 0)
+        fprintf(stderr, ", %.2f MB/s", (total - resumed) / secs / (1 << 20));
+    if (resumed > 0)
+        fprintf(stderr, ", %lld bytes resumed", (long long)resumed);
+    if (crc_enabled)
+        fprintf(stderr, ", crc32c %08x", output_crc(st, cnt));
+    fprintf(stderr, "\n");
+    out_cached = page_cache_bytes(outfile);
+    fprintf(stderr, "page cache: %.2f MB of the inputs", in_cached / 1048576.0);
+    if (out_cached >= 0)
+        fprintf(stderr, ", %.2f MB of the output", out_cached / 1048576.0);
+    fprintf(stderr, " resident\n");
+}
@@ -0,0 +1,204 @@
+#ifndef CONCAT_H
+#define CONCAT_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+
+/******************************************************************************
+ * Data structure definitions
+ */
+
+/* the way the bytes of an input reached the output */
+enum copy_path
+{
+    PATH_RW,         /* read() + write() through a user-space buffer */
+    PATH_COPY_RANGE, /* copy_file_range(), file to file inside the kernel */
+    PATH_SENDFILE,   /* sendfile(), file to anything */
+    PATH_SPLICE,     /* splice(), an input or the output is a pipe */
+    PATH_URING,      /* linked io_uring reads and writes */
+    PATH_MMAP,       /* write() straight from a mapping of the input */
+    PATH_GATHER,     /* read into a shared arena, written by one writev() */
+    PATH_PIPELINE,   /* reader and writer threads around a ring of buffers */
+    PATH_DIRECT,     /* O_DIRECT, around the page cache */
+    PATH_NOCACHE,    /* read/write, finished ranges dropped from the cache */
+    PATH_SPARSE,     /* data extents only, holes re-created in the output */
+    PATH_RESUMED     /* already in the output, copied by an earlier -J run */
+};
+
+/* copy strategy requested on the command line */
+enum copy_mode
+{
+    MODE_AUTO,     /* best kernel-side path, read/write loop as the fallback */
+    MODE_RW,       /* always use the read/write loop */
+    MODE_URING,    /* io_uring with several reads and writes in flight */
+    MODE_MMAP,     /* write from mmap()ed windows of the inputs */
+    MODE_GATHER,   /* batch small inputs into writev(), stream the rest */
+    MODE_PIPELINE, /* overlap reads and writes in two threads */
+    MODE_DIRECT,   /* O_DIRECT with aligned buffers */
+    MODE_NOCACHE   /* buffered, but give the page cache back behind us */
+};
+
+/* everything the command line can ask of a concatenation */
+struct concat_opts
+{
+    enum copy_mode mode;
+    int nr_threads;   /* > 0: parallel positional copy */
+    int depth;        /* requests in flight (uring) or buffers (pipeline) */
+    size_t buff_size; /* read/write buffer, 0 to size it per input */
+    int verbose;
+    int checksum; /* CRC32C of every input while it is copied */
+    int journal;  /* resumable copy, see concat_journaled() */
+    const char *manifest; /* -c: write the digests here */
+    const char *verify;   /* -C: check the digests against this one */
+    char **extras;        /* -o: copies of the output, see fan_out() */
+    int nr_extras;
+};
+
+/* per-input accounting, filled in by copy_fd() */
+struct copy_stats
+{
+    enum copy_path path;
+    off_t bytes;
+    off_t holes;   /* part of bytes that was skipped as holes */
+    off_t resumed; /* part of bytes an earlier -J run had copied */
+    unsigned long syscalls;
+    uint32_t crc; /* CRC32C of the bytes, with opts.checksum */
+};
+
+/******************************************************************************
+ * Helper Functions
+ */
+
+/* writes all len bytes of buff to fd, exits on error */
+void doWrite(int fd, const char *buff, size_t len);
+
+/* read/write buffer size for an input, from its size and st_blksize */
+size_t rw_buffer_size(const struct stat *sin);
+
+/* the shared read/write buffer, grown to at least size bytes */
+char *rw_buffer(size_t size);
+
+/* copies fd_in to the current offset of fd_out until EOF, exits on error */
+void copy_fd(int fd_out, int fd_in, enum copy_mode mode, struct copy_stats *st);
+
+/*
+ * Copies len bytes at in_off of fd_in to out_off of fd_out, with
+ * copy_file_range() or else pread()/pwrite(); the file offsets stay put.
+ * Exits if the input ends before len bytes.
+ */
+void copy_range(int fd_out, int fd_in, off_t in_off, off_t out_off,
+                off_t len, struct copy_stats *st);
+
+/* opens infile, copies it to fd_out and closes it again */
+void write_file(int fd_out, const char *infile, enum copy_mode mode,
+                struct copy_stats *st);
+
+/*
+ * Copies the cnt regular files into their precomputed offsets of the
+ * (empty) output using nr_threads threads. Returns the number of chunks.
+ */
+int concat_parallel(int fd_out, char **infiles, int cnt, int nr_threads,
+                    enum copy_mode mode, struct copy_stats *st);
+
+/*
+ * Copies the cnt regular files to fd_out through io_uring, keeping depth
+ * linked read/write pairs in flight. Returns -1, before copying anything,
+ * if io_uring or a regular output and inputs are not available.
+ */
+int concat_uring(int fd_out, char **infiles, int cnt, int depth,
+                 struct copy_stats *st);
+
+/*
+ * Reads small inputs into an arena and writes many of them with a single
+ * writev(); larger inputs and non-regular files are streamed as usual.
+ */
+void concat_gather(int fd_out, char **infiles, int cnt, struct copy_stats *st);
+
+/*
+ * A reader thread fills a ring of depth buffers while a writer thread
+ * drains it, so reading the inputs and writing the output overlap.
+ */
+void concat_pipeline(int fd_out, char **infiles, int cnt, int depth,
+                     size_t buff_size, struct copy_stats *st);
+
+/* read/write loop that drops finished ranges of fd_in and fd_out */
+void copy_nocache(int fd_out, int fd_in, const struct stat *sin,
+                  struct copy_stats *st);
+
+/*
+ * Copies through O_DIRECT with aligned buffers, falling back to
+ * copy_nocache()-style dropping where the filesystem refuses O_DIRECT.
+ */
+void concat_direct(int fd_out, char **infiles, int cnt, struct copy_stats *st);
+
+/* set by concat_files() when the copy paths have to checksum */
+extern int crc_enabled;
+
+/* CRC32C of buff continuing from crc, 0 to start; SSE4.2 where available */
+uint32_t crc32c(uint32_t crc, const void *buff, size_t len);
+
+/* the CRC32C of two blocks back to back, from their CRCs */
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, off_t len2);
+
+/* adds buff to the CRC of the input, if checksums were asked for */
+void crc_account(struct copy_stats *st, const void *buff, size_t len);
+
+/* the CRC32C of the whole output, from the CRCs of its inputs */
+uint32_t output_crc(const struct copy_stats *st, int cnt);
+
+/* writes the digests of the inputs and the output to a manifest file */
+void write_manifest(const char *path, char **names,
+                    const struct copy_stats *st, int cnt, const char *outfile);
+
+/*
+ * Compares the digests with a manifest of an earlier run, reporting each
+ * difference to stderr. Returns the number of differences.
+ */
+int verify_manifest(const char *path, char **names,
+                    const struct copy_stats *st, int cnt, const char *outfile);
+
+/*
+ * Copies the regular files to outfile.part, recording the confirmed
+ * length in outfile.journal every 64 MiB after an fdatasync(). A run
+ * over the same unchanged inputs picks up at that length. The finished
+ * file is renamed over outfile and the journal removed.
+ */
+void concat_journaled(const char *outfile, char **infiles, int cnt,
+                      struct copy_stats *st, int verbose);
+
+/* bytes of the file that currently sit in the page cache, -1 if unknown */
+off_t page_cache_bytes(const char *path);
+
+/* concatenates infiles to fd_out as opts asks, the entry point of the tools */
+void concat_files(int fd_out, char **infiles, int cnt,
+                  const struct concat_opts *opts, struct copy_stats *st);
+
+/*
+ * Copies the finished output file to each of the extra destinations
+ * ("-" is stdout) straight from the page cache: copy_file_range() to
+ * files, splice() to pipes and sendfile() to anything else.
+ */
+void fan_out(const char *outfile, char **extras, int nr, int verbose);
+
+const char *copy_path_name(enum copy_path path);
+
+/* parses the argument of -m, returns -1 for an unknown mode */
+int parse_copy_mode(const char *name, enum copy_mode *mode);
+
+/* prints synopsis and the options of the tools to stderr and exits */
+void concat_usage(const char *synopsis);
+
+/*
+ * Fills in opts from the defaults and the options of the command line,
+ * calling concat_usage() on a bad one. Returns the index of the first
+ * file argument; opts->extras is malloc()ed.
+ */
+int parse_concat_opts(int argc, char **argv, const char *synopsis,
+                      struct concat_opts *opts);
+
+/* prints the per-input and total accounting to stderr */
+void print_report(char **names, const struct copy_stats *st, int cnt,
+                  const char *outfile, double secs);
+
+#endif /* CONCAT_H */
@@ -0,0 +1,369 @@
+/*
+ * fconc-bench.c
+ *
+ * Runs every copy strategy of fconc over generated input sets, with a
+ * warm and a cold page cache, and prints one CSV line per run, including
+ * how much page cache the run left behind.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+
+#include "concat.h"
+
+#define MAX_LIST 16
+#define GEN_BUFF_SIZE (1 << 20)
+
+/* one column of the matrix: a copy strategy and its knobs */
+struct strategy
+{
+    const char *name;
+    enum copy_mode mode;
+    int nr_threads;
+    size_t buff_size;
+};
+
+/* what a single run measured */
+struct result
+{
+    long long bytes;
+    unsigned long syscalls;
+    double secs;
+    double cpu_secs;
+    long long cached; /* page cache held by the inputs and output afterwards */
+};
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: ./fconc-bench [options]\n");
+    fprintf(stderr, "  -d dir      where the input sets live (default: bench-data)\n"
+                    "  -s sizes    input sizes (default: 1K,64K,1M,64M,1G,10G)\n"
+                    "  -n counts   inputs per set (default: 2,100,10000,100000)\n"
+                    "  -t bytes    skip sets larger than this (default: 4G)\n"
+                    "  -b sizes    read/write buffer sizes (default: 1K,4K,64K,1M)\n"
+                    "  -j threads  thread counts of -j (default: 2,4,8)\n"
+                    "  -r reps     runs of each cell (default: 1)\n");
+    exit(1);
+}
+
+/* "64K" -> 65536 */
+static long long parse_size(const char *s)
+{
+    char *end;
+    long long v = strtoll(s, &end, 10);
+
+    switch (*end)
+    {
+    case 'G':
+    case 'g':
+        v <<= 10;
+        /* fall through */
+    case 'M':
+    case 'm':
+        v <<= 10;
+        /* fall through */
+    case 'K':
+    case 'k':
+        v <<= 10;
+        end++;
+    }
+    if (end == s || (*end != '\0' && *end != ',') || v <= 0)
+        usage();
+    return v;
+}
+
+static int parse_list(const char *s, long long *out)
+{
+    int cnt = 0;
+
+    for (;;)
+    {
+        if (cnt == MAX_LIST)
+            usage();
+        out[cnt++] = parse_size(s);
+        s = strchr(s, ',');
+        if (s == NULL)
+            break;
+        s++;
+    }
+    return cnt;
+}
+
+static void fill_file(const char *name, long long size, char *buff)
+{
+    struct stat st;
+    long long done;
+    int fd;
+
+    if (stat(name, &st) == 0 && st.st_size == size)
+        return; /* left over from an earlier run */
+
+    fd = open(name, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd == -1)
+    {
+        perror(name);
+        exit(1);
+    }
+    for (done = 0; done < size; done += GEN_BUFF_SIZE)
+        doWrite(fd, buff, size - done < GEN_BUFF_SIZE ? size - done
+                                                      : GEN_BUFF_SIZE);
+    /* clean pages, so that POSIX_FADV_DONTNEED can drop them later */
+    fdatasync(fd);
+    close(fd);
+}
+
+/* creates (or reuses) dir/set-<size>-<count>/f<i> and returns the names */
+static char **make_set(const char *dir, long long size, int count, char *buff)
+{
+    char path[4096];
+    char **names;
+
+    snprintf(path, sizeof(path), "%s/set-%lld-%d", dir, size, count);
+    if (mkdir(path, 0755) == -1 && errno != EEXIST)
+    {
+        perror(path);
+        exit(1);
+    }
+    names = malloc(count * sizeof(*names));
+    if (names == NULL)
+    {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i < count; ++i)
+    {
+        snprintf(path, sizeof(path), "%s/set-%lld-%d/f%06d", dir, size, count,
+                 i);
+        names[i] = strdup(path);
+        fill_file(names[i], size, buff);
+    }
+    return names;
+}
+
+static void drop_cache(char **names, int count)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        int fd = open(names[i], O_RDONLY);
+        if (fd == -1)
+            continue;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+static double seconds(const struct timeval *tv)
+{
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+/* concatenates the set in a child, so that its CPU time can be taken apart */
+static void run(const struct strategy *s, char **names, int count,
+                const char *outfile, struct result *res)
+{
+    struct concat_opts opts = {.mode = s->mode, .depth = 16};
+    struct timespec t0, t1;
+    struct rusage ru;
+    int pfd[2], status;
+    pid_t pid;
+
+    opts.nr_threads = s->nr_threads;
+    opts.buff_size = s->buff_size;
+    if (pipe(pfd) == -1)
+    {
+        perror("pipe");
+        exit(1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pid = fork();
+    if (pid < 0)
+    {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0)
+    {
+        struct copy_stats *st = calloc(count, sizeof(*st));
+        struct result r = {0, 0, 0, 0, 0};
+        int fd_out;
+
+        close(pfd[0]);
+        fd_out = open(outfile, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+        if (st == NULL || fd_out == -1)
+        {
+            perror(outfile);
+            exit(1);
+        }
+        concat_files(fd_out, names, count, &opts, st);
+        fdatasync(fd_out);
+        close(fd_out);
+        for (int i = 0; i < count; ++i)
+        {
+            r.bytes += st[i].bytes;
+            r.syscalls += st[i].syscalls;
+        }
+        if (write(pfd[1], &r, sizeof(r)) != sizeof(r))
+            exit(1);
+        exit(0);
+    }
+    close(pfd[1]);
+    if (read(pfd[0], res, sizeof(*res)) != sizeof(*res))
+    {
+        fprintf(stderr, "%s: child reported nothing\n", s->name);
+        exit(1);
+    }
+    close(pfd[0]);
+    if (wait4(pid, &status, 0, &ru) == -1 || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0)
+    {
+        fprintf(stderr, "%s: child failed\n", s->name);
+        exit(1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    res->secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    res->cpu_secs = seconds(&ru.ru_utime) + seconds(&ru.ru_stime);
+
+    res->cached = page_cache_bytes(outfile);
+    for (int i = 0; i < count; ++i)
+        res->cached += page_cache_bytes(names[i]);
+}
+
+int main(int argc, char **argv)
+{
+    const char *dir = "bench-data";
+    long long sizes[MAX_LIST], counts[MAX_LIST], buffs[MAX_LIST];
+    long long threads[MAX_LIST], max_total = 4LL << 30;
+    int nr_sizes, nr_counts, nr_buffs, nr_threads, reps = 1, opt;
+    struct strategy strats[3 * MAX_LIST];
+    int nr_strats = 0;
+    char outfile[4096], *buff;
+
+    nr_sizes = parse_list("1K,64K,1M,64M,1G,10G", sizes);
+    nr_counts = parse_list("2,100,10000,100000", counts);
+    nr_buffs = parse_list("1K,4K,64K,1M", buffs);
+    nr_threads = parse_list("2,4,8", threads);
+    while ((opt = getopt(argc, argv, "d:s:n:t:b:j:r:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            dir = optarg;
+            break;
+        case 's':
+            nr_sizes = parse_list(optarg, sizes);
+            break;
+        case 'n':
+            nr_counts = parse_list(optarg, counts);
+            break;
+        case 't':
+            max_total = parse_size(optarg);
+            break;
+        case 'b':
+            nr_buffs = parse_list(optarg, buffs);
+            break;
+        case 'j':
+            nr_threads = parse_list(optarg, threads);
+            break;
+        case 'r':
+            reps = atoi(optarg);
+            if (reps <= 0)
+                usage();
+            break;
+        default:
+            usage();
+        }
+    }
+
+    for (int i = 0; i < nr_buffs; ++i)
+        strats[nr_strats++] = (struct strategy){"rw", MODE_RW, 0, buffs[i]};
+    strats[nr_strats++] = (struct strategy){"auto", MODE_AUTO, 0, 0};
+    strats[nr_strats++] = (struct strategy){"mmap", MODE_MMAP, 0, 0};
+    strats[nr_strats++] = (struct strategy){"uring", MODE_URING, 0, 0};
+    strats[nr_strats++] = (struct strategy){"gather", MODE_GATHER, 0, 0};
+    strats[nr_strats++] = (struct strategy){"pipeline", MODE_PIPELINE, 0, 0};
+    strats[nr_strats++] = (struct strategy){"direct", MODE_DIRECT, 0, 0};
+    strats[nr_strats++] = (struct strategy){"nocache", MODE_NOCACHE, 0, 0};
+    for (int i = 0; i < nr_threads; ++i)
+        strats[nr_strats++] = (struct strategy){"parallel", MODE_AUTO,
+                                                (int)threads[i], 0};
+
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+    {
+        perror(dir);
+        exit(1);
+    }
+    snprintf(outfile, sizeof(outfile), "%s/out", dir);
+    buff = malloc(GEN_BUFF_SIZE);
+    if (buff == NULL)
+    {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i < GEN_BUFF_SIZE; ++i)
+        buff[i] = rand();
+
+    printf("size,count,strategy,threads,buffer,cache,bytes,seconds,"
+           "gb_per_s,syscalls_per_mb,cpu_seconds,cached_mb\n");
+    fflush(stdout); /* or every child flushes it again */
+    for (int si = 0; si < nr_sizes; ++si)
+    {
+        for (int ci = 0; ci < nr_counts; ++ci)
+        {
+            long long size = sizes[si];
+            int count = counts[ci];
+            char **names;
+
+            if (size * count > max_total)
+            {
+                fprintf(stderr, "skipping %lld x %d: more than -t bytes\n",
+                        size, count);
+                continue;
+            }
+            fprintf(stderr, "set %lld x %d...\n", size, count);
+            names = make_set(dir, size, count, buff);
+
+            for (int k = 0; k < nr_strats; ++k)
+            {
+                for (int cold = 0; cold <= 1; ++cold)
+                {
+                    for (int r = 0; r < reps; ++r)
+                    {
+                        struct result res;
+
+                        if (cold)
+                            drop_cache(names, count);
+                        else if (r == 0)
+                            run(&strats[k], names, count, outfile, &res);
+                        run(&strats[k], names, count, outfile, &res);
+                        unlink(outfile);
+                        printf("%lld,%d,%s,%d,%zu,%s,%lld,%.6f,%.3f,%.2f,%.6f,"
+                               "%.2f\n",
+                               size, count, strats[k].name,
+                               strats[k].nr_threads, strats[k].buff_size,
+                               cold ? "cold" : "warm", res.bytes, res.secs,
+                               res.secs > 0 ? res.bytes / res.secs / 1e9 : 0,
+                               res.bytes > 0 ? res.syscalls / (res.bytes / 1048576.0)
+                                             : 0,
+                               res.cpu_secs, res.cached / 1048576.0);
+                        fflush(stdout);
+                    }
+                }
+            }
+            for (int i = 0; i < count; ++i)
+                free(names[i]);
+            free(names);
+        }
+    }
+    free(buff);
+    return 0;
+}
@@ -5,73 +5,41 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
 
-void doWrite(int fd, const char *buff, size_t len)
-{
-    size_t idx = 0;
-    ssize_t wcount = 0;
-    do
-    {
-        wcount = write(fd, buff + idx, len - idx);
-        if (wcount == -1)
-        { /* error */
-            perror("write");
-            exit(1);
-        }
-        idx += wcount;
-    } while (idx < len);
-}
+#include "concat.h"
 
-void write_file(int fd, const char *infile)
-{
-    char buff[1024];
-    ssize_t rcnt = 0; 
-    int fd3;
-
-    fd3 = open(infile, O_RDONLY);
-    if (fd3 == -1)
-    {
-        perror("open error");
-        exit(1);
-    }
-    for (;;)
-    {
-        rcnt = read(fd3, buff, sizeof(buff));
-        if (rcnt == 0)
-            break;
-        if (rcnt == -1)
-        { /* error */
-            perror("read");
-            close(fd3);
-            exit(1);
-        }
-        doWrite(fd, buff, rcnt);
-    }
-    close(fd3);
-}
+static const char synopsis[] = "Usage: ./fconc [options] infile1 infile2 "
+                               "[outfile (default:fconc.out)]\n";
 
 int main(int argc, char **argv)
 {
+    struct concat_opts opts;
+    int first, bad = 0;
+
+    first = parse_concat_opts(argc, argv, synopsis, &opts);
+    argc -= first - 1;
+    argv += first - 1;
+
     if (argc <= 2 || argc > 4)
     {
-        perror("Usage: ./fconc infile1 infile2 [outfile (default:fconc.out)]");
-        exit(1);
+        concat_usage(synopsis);
     }
     else
     {
-        int fd_out, oflags, mode;
+        int fd_out, oflags, mode_bits;
+        const char *outfile = argc == 3 ? "fconc.out" : argv[3];
+        struct copy_stats st[2];
+        struct timespec t0, t1;
+
         oflags = O_CREAT | O_WRONLY | O_TRUNC;
-        mode = S_IRUSR | S_IWUSR;
-        if (argc == 3)
-        {
-            fd_out = open("fconc.out", oflags, mode);
-        }
-        else
-        {
-            fd_out = open(argv[3], oflags, mode);
-        }
-        
-        if (fd_out == -1)
+        mode_bits = S_IRUSR | S_IWUSR;
+        /* -J writes outfile.part and renames it over outfile when done */
+        fd_out = -1;
+        if (!opts.journal)
+            fd_out = open(outfile, oflags, mode_bits);
+
+        if (!opts.journal && fd_out == -1)
         {
             perror("Cannot open the file");
             exit(1);
@@ -79,10 +47,29 @@ int main(int argc, char **argv)
         // If the file openned succesfully proceed to writing
         else
         {
-            write_file(fd_out, argv[1]);
-            write_file(fd_out, argv[2]);
-            close(fd_out);
+            memset(st, 0, sizeof(st));
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            if (opts.journal)
+            {
+                concat_journaled(outfile, argv + 1, 2, st, opts.verbose);
+            }
+            else
+            {
+                concat_files(fd_out, argv + 1, 2, &opts, st);
+                close(fd_out);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            if (opts.verbose)
+                print_report(argv + 1, st, 2, outfile,
+                             (t1.tv_sec - t0.tv_sec) +
+                                 (t1.tv_nsec - t0.tv_nsec) / 1e9);
+            fan_out(outfile, opts.extras, opts.nr_extras, opts.verbose);
+            if (opts.manifest != NULL)
+                write_manifest(opts.manifest, argv + 1, st, 2, outfile);
+            if (opts.verify != NULL)
+                bad = verify_manifest(opts.verify, argv + 1, st, 2, outfile);
         }
     }
-    return 0;
+    free(opts.extras);
+    return bad ? 1 : 0;
 }
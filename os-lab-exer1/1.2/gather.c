@@ -0,0 +1,144 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "concat.h"
+
+/* inputs up to this size are gathered, bigger ones are streamed */
+#define GATHER_SMALL (64 << 10)
+/* the arena the small inputs are read into */
+#define GATHER_ARENA (4 << 20)
+
+struct gather
+{
+    int fd_out;
+    char *arena;
+    size_t used;
+    struct iovec iov[IOV_MAX];
+    int nr_iov;
+};
+
+/* writes out everything gathered so far with as few writev() as possible */
+static void gather_flush(struct gather *g, struct copy_stats *st)
+{
+    struct iovec *iov = g->iov;
+    int nr = g->nr_iov;
+    ssize_t n;
+
+    while (nr > 0)
+    {
+        n = writev(g->fd_out, iov, nr);
+        st->syscalls++;
+        if (n == -1)
+        {
+            perror("writev");
+            exit(1);
+        }
+        /* skip what a short writev did write and retry the rest */
+        while (nr > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            nr--;
+        }
+        if (nr > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    g->nr_iov = 0;
+    g->used = 0;
+}
+
+/* reads a small regular input whole into the arena, returns its length */
+static size_t gather_read(struct gather *g, int fd_in, size_t size,
+                          struct copy_stats *st)
+{
+    size_t got = 0;
+    ssize_t n;
+
+    while (got < size)
+    {
+        n = read(fd_in, g->arena + g->used + got, size - got);
+        st->syscalls++;
+        if (n == -1)
+        {
+            perror("read");
+            exit(1);
+        }
+        if (n == 0)
+            break; /* shrank since fstat(), take what is there */
+        got += n;
+    }
+    return got;
+}
+
+void concat_gather(int fd_out, char **infiles, int cnt, struct copy_stats *st)
+{
+    struct gather *g;
+    struct stat sin;
+
+    g = malloc(sizeof(*g));
+    if (g == NULL || (g->arena = malloc(GATHER_ARENA)) == NULL)
+    {
+        perror("malloc");
+        exit(1);
+    }
+    g->fd_out = fd_out;
+    g->used = 0;
+    g->nr_iov = 0;
+
+    for (int i = 0; i < cnt; ++i)
+    {
+        int fd_in = open(infiles[i], O_RDONLY);
+
+        if (fd_in == -1)
+        {
+            perror("open error");
+            exit(1);
+        }
+        if (fstat(fd_in, &sin) == -1)
+        {
+            perror("fstat");
+            exit(1);
+        }
+        st[i].syscalls += 3; /* open/fstat/close */
+
+        if (!S_ISREG(sin.st_mode) || sin.st_size > GATHER_SMALL)
+        {
+            /* keep the output in order, then stream this one */
+            gather_flush(g, &st[i]);
+            copy_fd(fd_out, fd_in, MODE_AUTO, &st[i]);
+            close(fd_in);
+            continue;
+        }
+
+        if (g->used + sin.st_size > GATHER_ARENA || g->nr_iov == IOV_MAX)
+            gather_flush(g, &st[i]);
+        size_t len = gather_read(g, fd_in, sin.st_size, &st[i]);
+        close(fd_in);
+        crc_account(&st[i], g->arena + g->used, len);
+        if (len > 0)
+        {
+            g->iov[g->nr_iov].iov_base = g->arena + g->used;
+            g->iov[g->nr_iov].iov_len = len;
+            g->nr_iov++;
+            g->used += len;
+        }
+        st[i].bytes = len;
+        st[i].path = PATH_GATHER;
+    }
+    if (cnt > 0)
+        gather_flush(g, &st[cnt - 1]);
+
+    free(g->arena);
+    free(g);
+}
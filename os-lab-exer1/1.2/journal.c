@@ -0,0 +1,295 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "concat.h"
+
+/* the output is synced and its length recorded at least this often */
+#define JOURNAL_INTERVAL (64 << 20)
+/* digits of the checkpoint, a fixed width so it is rewritten in place */
+#define CHECKPOINT_WIDTH 20
+
+struct journal
+{
+    int fd;
+    off_t at;        /* offset of the checkpoint in the journal */
+    off_t confirmed; /* output bytes known to be on disk */
+};
+
+/* outfile with a suffix, e.g. "out.part" */
+static char *side_name(const char *outfile, const char *suffix)
+{
+    char *name = malloc(strlen(outfile) + strlen(suffix) + 1);
+
+    if (name == NULL)
+    {
+        perror("malloc");
+        exit(1);
+    }
+    strcpy(name, outfile);
+    strcat(name, suffix);
+    return name;
+}
+
+/*
+ * The part of the journal that identifies the run: every input with its
+ * size and mtime, so a changed input is never resumed. Fills in sizes.
+ */
+static char *journal_header(char **infiles, int cnt, off_t *sizes,
+                            size_t *len)
+{
+    struct stat sin;
+    char *header;
+    FILE *fp;
+
+    fp = open_memstream(&header, len);
+    if (fp == NULL)
+    {
+        perror("open_memstream");
+        exit(1);
+    }
+    fprintf(fp, "fconc journal\n%d inputs\n", cnt);
+    for (int i = 0; i < cnt; ++i)
+    {
+        if (stat(infiles[i], &sin) == -1)
+        {
+            perror(infiles[i]);
+            exit(1);
+        }
+        if (!S_ISREG(sin.st_mode))
+        {
+            fprintf(stderr, "%s: -J needs regular inputs\n", infiles[i]);
+            exit(1);
+        }
+        sizes[i] = sin.st_size;
+        fprintf(fp, "%lld %lld.%09ld %s\n", (long long)sin.st_size,
+                (long long)sin.st_mtim.tv_sec, sin.st_mtim.tv_nsec,
+                infiles[i]);
+    }
+    fprintf(fp, "confirmed ");
+    fclose(fp);
+    return header;
+}
+
+/* the checkpoint of an earlier run of the same inputs, -1 if there is none */
+static off_t journal_load(const char *name, const char *header, size_t hlen)
+{
+    size_t want = hlen + CHECKPOINT_WIDTH + 1;
+    char *buff, *end;
+    off_t confirmed = -1;
+    FILE *fp;
+
+    fp = fopen(name, "r");
+    if (fp == NULL)
+        return -1;
+    buff = malloc(want + 1);
+    if (buff == NULL)
+    {
+        perror("malloc");
+        exit(1);
+    }
+    if (fread(buff, 1, want, fp) == want && !memcmp(buff, header, hlen) &&
+        buff[want - 1] == '\n')
+    {
+        buff[want - 1] = '\0';
+        confirmed = strtoll(buff + hlen, &end, 10);
+        if (*end != '\0')
+            confirmed = -1;
+    }
+    else
+    {
+        fprintf(stderr, "%s: written for other inputs, starting over\n", name);
+    }
+    free(buff);
+    fclose(fp);
+    return confirmed;
+}
+
+/* makes the output durable up to done, then records that in the journal */
+static void checkpoint(struct journal *j, int fd_out, off_t done,
+                       struct copy_stats *st)
+{
+    char num[CHECKPOINT_WIDTH + 2];
+
+    if (fdatasync(fd_out) == -1)
+    {
+        perror("fdatasync");
+        exit(1);
+    }
+    snprintf(num, sizeof(num), "%0*lld\n", CHECKPOINT_WIDTH, (long long)done);
+    if (pwrite(j->fd, num, CHECKPOINT_WIDTH + 1, j->at) != CHECKPOINT_WIDTH + 1 ||
+        fdatasync(j->fd) == -1)
+    {
+        perror("journal");
+        exit(1);
+    }
+    st->syscalls += 3;
+    j->confirmed = done;
+}
+
+static void journal_create(struct journal *j, const char *name,
+                           const char *header, size_t hlen)
+{
+    j->fd = open(name, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (j->fd == -1)
+    {
+        perror(name);
+        exit(1);
+    }
+    doWrite(j->fd, header, hlen);
+    j->at = hlen;
+    j->confirmed = 0;
+}
+
+/* a rename is only durable once its directory is synced */
+static void sync_dir(const char *path)
+{
+    char *copy = strdup(path);
+    int fd;
+
+    if (copy == NULL)
+        return;
+    fd = open(dirname(copy), O_RDONLY | O_DIRECTORY);
+    if (fd != -1)
+    {
+        fsync(fd);
+        close(fd);
+    }
+    free(copy);
+}
+
+void concat_journaled(const char *outfile, char **infiles, int cnt,
+                      struct copy_stats *st, int verbose)
+{
+    char *header, *part, *jname;
+    struct journal j;
+    struct stat spart;
+    off_t *sizes, total = 0, out_off = 0, last;
+    size_t hlen;
+    int fd_out = -1;
+
+    sizes = malloc((cnt + 1) * sizeof(*sizes));
+    if (sizes == NULL)
+    {
+        perror("malloc");
+        exit(1);
+    }
+    header = journal_header(infiles, cnt, sizes, &hlen);
+    for (int i = 0; i < cnt; ++i)
+        total += sizes[i];
+    part = side_name(outfile, ".part");
+    jname = side_name(outfile, ".journal");
+
+    j.confirmed = journal_load(jname, header, hlen);
+    if (j.confirmed >= 0)
+    {
+        /* the output may be longer than confirmed, never shorter */
+        fd_out = open(part, O_WRONLY);
+        if (fd_out != -1 && (fstat(fd_out, &spart) == -1 ||
+                             spart.st_size < j.confirmed ||
+                             j.confirmed > total))
+        {
+            close(fd_out);
+            fd_out = -1;
+        }
+        if (fd_out == -1)
+            fprintf(stderr, "%s: does not match %s, starting over\n", part,
+                    jname);
+    }
+    if (fd_out == -1)
+    {
+        fd_out = open(part, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+        if (fd_out == -1)
+        {
+            perror(part);
+            exit(1);
+        }
+        journal_create(&j, jname, header, hlen);
+        if (cnt > 0)
+            checkpoint(&j, fd_out, 0, &st[0]);
+    }
+    else
+    {
+        j.fd = open(jname, O_WRONLY);
+        j.at = hlen;
+        if (j.fd == -1)
+        {
+            perror(jname);
+            exit(1);
+        }
+        if (verbose)
+            fprintf(stderr, "resuming at %lld of %lld bytes\n",
+                    (long long)j.confirmed, (long long)total);
+    }
+    if (total > 0 && fallocate(fd_out, 0, 0, total) == -1 &&
+        ftruncate(fd_out, total) == -1)
+    {
+        perror("fallocate");
+        exit(1);
+    }
+
+    last = j.confirmed;
+    for (int i = 0; i < cnt; out_off += sizes[i], ++i)
+    {
+        off_t off, len;
+        int fd_in;
+
+        if (out_off + sizes[i] <= j.confirmed)
+        {
+            /* copied by an earlier run */
+            st[i].path = PATH_RESUMED;
+            st[i].bytes = st[i].resumed = sizes[i];
+            continue;
+        }
+        fd_in = open(infiles[i], O_RDONLY);
+        if (fd_in == -1)
+        {
+            perror("open error");
+            exit(1);
+        }
+        st[i].syscalls += 2; /* open/close */
+        st[i].path = PATH_COPY_RANGE;
+        off = j.confirmed > out_off ? j.confirmed - out_off : 0;
+        st[i].bytes = st[i].resumed = off;
+        for (; off < sizes[i]; off += len)
+        {
+            len = sizes[i] - off < JOURNAL_INTERVAL ? sizes[i] - off
+                                                    : JOURNAL_INTERVAL;
+            copy_range(fd_out, fd_in, off, out_off + off, len, &st[i]);
+            if (out_off + off + len - last >= JOURNAL_INTERVAL)
+            {
+                checkpoint(&j, fd_out, out_off + off + len, &st[i]);
+                last = j.confirmed;
+            }
+        }
+        close(fd_in);
+    }
+
+    /* publish: the complete file replaces outfile in one rename */
+    if (fsync(fd_out) == -1 || close(fd_out) == -1)
+    {
+        perror(part);
+        exit(1);
+    }
+    if (rename(part, outfile) == -1)
+    {
+        perror("rename");
+        exit(1);
+    }
+    sync_dir(outfile);
+    close(j.fd);
+    unlink(jname);
+    if (cnt > 0)
+        st[cnt - 1].syscalls += 6;
+
+    free(jname);
+    free(part);
+    free(header);
+    free(sizes);
+}
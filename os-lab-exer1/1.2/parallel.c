@@ -0,0 +1,279 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "concat.h"
+
+/* inputs larger than this are split so that every worker gets a share */
+#define PAR_CHUNK_MIN (8 << 20)
+/* pread/pwrite buffer of each worker */
+#define PAR_BUFF_SIZE (1 << 20)
+
+#define perror_pthread(ret, msg) \
+    do                           \
+    {                            \
+        errno = ret;             \
+        perror(msg);             \
+    } while (0)
+
+/* a piece of one input and the place it goes to in the output */
+struct chunk
+{
+    int input;
+    off_t in_off;
+    off_t out_off;
+    off_t len;
+};
+
+struct par_job
+{
+    int fd_out;
+    char **infiles;
+    enum copy_mode mode;
+    struct chunk *chunks;
+    int nr_chunks;
+    int next; /* first chunk nobody has taken yet */
+    struct copy_stats *st;
+    pthread_mutex_t lock;
+};
+
+static void copy_chunk_rw(int fd_out, int fd_in, const struct chunk *c,
+                          char *buff, unsigned long *calls)
+{
+    off_t done = 0;
+    ssize_t rcnt, wcnt;
+
+    while (done < c->len)
+    {
+        size_t want = c->len - done < PAR_BUFF_SIZE ? c->len - done
+                                                    : PAR_BUFF_SIZE;
+        rcnt = pread(fd_in, buff, want, c->in_off + done);
+        (*calls)++;
+        if (rcnt == -1)
+        {
+            perror("pread");
+            exit(1);
+        }
+        if (rcnt == 0)
+        {
+            fprintf(stderr, "input shrank while copying\n");
+            exit(1);
+        }
+        for (ssize_t idx = 0; idx < rcnt; idx += wcnt)
+        {
+            wcnt = pwrite(fd_out, buff + idx, rcnt - idx,
+                          c->out_off + done + idx);
+            (*calls)++;
+            if (wcnt == -1)
+            {
+                perror("pwrite");
+                exit(1);
+            }
+        }
+        done += rcnt;
+    }
+}
+
+/* returns the path used; falls back to pread/pwrite when the kernel refuses */
+static enum copy_path copy_chunk(int fd_out, int fd_in, const struct chunk *c,
+                                 enum copy_mode mode, char *buff,
+                                 unsigned long *calls)
+{
+    off_t in_off = c->in_off, out_off = c->out_off;
+    off_t done = 0;
+    ssize_t n;
+
+    while (mode == MODE_AUTO && done < c->len)
+    {
+        n = copy_file_range(fd_in, &in_off, fd_out, &out_off, c->len - done, 0);
+        (*calls)++;
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && done == 0 && (errno == EXDEV || errno == EINVAL ||
+                                     errno == ENOSYS || errno == EOPNOTSUPP))
+            break;
+        if (n == -1)
+        {
+            perror("copy_file_range");
+            exit(1);
+        }
+        if (n == 0)
+        {
+            fprintf(stderr, "input shrank while copying\n");
+            exit(1);
+        }
+        done += n;
+    }
+    if (done == c->len)
+        return PATH_COPY_RANGE;
+    copy_chunk_rw(fd_out, fd_in, c, buff, calls);
+    return PATH_RW;
+}
+
+static void *worker(void *arg)
+{
+    struct par_job *job = arg;
+    char *buff;
+    int ret;
+
+    buff = malloc(PAR_BUFF_SIZE);
+    if (buff == NULL)
+    {
+        perror("malloc");
+        exit(1);
+    }
+    for (;;)
+    {
+        struct chunk *c;
+        enum copy_path path;
+        unsigned long calls = 0;
+        int fd_in;
+
+        ret = pthread_mutex_lock(&job->lock);
+        if (ret)
+        {
+            perror_pthread(ret, "pthread_mutex_lock");
+            exit(1);
+        }
+        c = job->next < job->nr_chunks ? &job->chunks[job->next++] : NULL;
+        pthread_mutex_unlock(&job->lock);
+        if (c == NULL)
+            break;
+
+        fd_in = open(job->infiles[c->input], O_RDONLY);
+        if (fd_in == -1)
+        {
+            perror("open error");
+            exit(1);
+        }
+        path = copy_chunk(job->fd_out, fd_in, c, job->mode, buff, &calls);
+        close(fd_in);
+
+        pthread_mutex_lock(&job->lock);
+        job->st[c->input].path = path;
+        job->st[c->input].bytes += c->len;
+        job->st[c->input].syscalls += calls + 2; /* + open/close */
+        pthread_mutex_unlock(&job->lock);
+    }
+    free(buff);
+    return NULL;
+}
+
+/*
+ * Positional concatenation: every input already knows where it starts in
+ * the output, so the pieces can be copied in any order by any thread.
+ */
+int concat_parallel(int fd_out, char **infiles, int cnt, int nr_threads,
+                    enum copy_mode mode, struct copy_stats *st)
+{
+    struct par_job job;
+    struct stat *sin;
+    pthread_t *threads;
+    off_t total = 0, chunk_size, off;
+    int i, ret;
+
+    sin = malloc(cnt * sizeof(*sin));
+    if (sin == NULL)
+    {
+        perror("malloc");
+        exit(1);
+    }
+    for (i = 0; i < cnt; ++i)
+    {
+        if (stat(infiles[i], &sin[i]) == -1)
+        {
+            perror(infiles[i]);
+            exit(1);
+        }
+        if (!S_ISREG(sin[i].st_mode))
+        {
+            /* unknown size, offsets cannot be precomputed */
+            fprintf(stderr, "%s: not a regular file, copying sequentially\n",
+                    infiles[i]);
+            free(sin);
+            for (i = 0; i < cnt; ++i)
+                write_file(fd_out, infiles[i], mode, &st[i]);
+            return 0;
+        }
+        total += sin[i].st_size;
+    }
+
+    /* reserve the whole output now, the workers fill it in any order */
+    if (total > 0 && fallocate(fd_out, 0, 0, total) == -1 &&
+        ftruncate(fd_out, total) == -1)
+    {
+        perror("fallocate");
+        exit(1);
+    }
+
+    chunk_size = total / (nr_threads * 4);
+    if (chunk_size < PAR_CHUNK_MIN)
+        chunk_size = PAR_CHUNK_MIN;
+
+    job.nr_chunks = 0;
+    for (i = 0; i < cnt; ++i)
+        job.nr_chunks += (sin[i].st_size + chunk_size - 1) / chunk_size;
+    job.chunks = malloc((job.nr_chunks + 1) * sizeof(*job.chunks));
+    threads = malloc(nr_threads * sizeof(*threads));
+    if (job.chunks == NULL || threads == NULL)
+    {
+        perror("malloc");
+        exit(1);
+    }
+    job.nr_chunks = 0;
+    for (i = 0, off = 0; i < cnt; off += sin[i].st_size, ++i)
+    {
+        for (off_t o = 0; o < sin[i].st_size; o += chunk_size)
+        {
+            struct chunk *c = &job.chunks[job.nr_chunks++];
+            c->input = i;
+            c->in_off = o;
+            c->out_off = off + o;
+            c->len = sin[i].st_size - o < chunk_size ? sin[i].st_size - o
+                                                     : chunk_size;
+        }
+        st[i].path = mode == MODE_AUTO ? PATH_COPY_RANGE : PATH_RW;
+    }
+    free(sin);
+
+    job.fd_out = fd_out;
+    job.infiles = infiles;
+    job.mode = mode;
+    job.next = 0;
+    job.st = st;
+    pthread_mutex_init(&job.lock, NULL);
+
+    for (i = 0; i < nr_threads; ++i)
+    {
+        ret = pthread_create(&threads[i], NULL, worker, &job);
+        if (ret)
+        {
+            perror_pthread(ret, "pthread_create");
+            exit(1);
+        }
+    }
+    for (i = 0; i < nr_threads; ++i)
+    {
+        ret = pthread_join(threads[i], NULL);
+        if (ret)
+        {
+            perror_pthread(ret, "pthread_join");
+            exit(1);
+        }
+    }
+    pthread_mutex_destroy(&job.lock);
+
+    /* leave the output offset at its end, as the sequential copy does */
+    lseek(fd_out, total, SEEK_SET);
+
+    free(threads);
+    free(job.chunks);
+    return job.nr_chunks;
+}
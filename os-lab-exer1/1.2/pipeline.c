@@ -0,0 +1,203 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "concat.h"
+
+/* size of each ring buffer unless -b says otherwise */
+#define PIPE_BUFF_SIZE (1 << 20)
+
+#define perror_pthread(ret, msg) \
+    do                           \
+    {                            \
+        errno = ret;             \
+        perror(msg);             \
+    } while (0)
+
+/* a filled buffer on its way from the reader to the writer */
+struct ring_slot
+{
+    char *buff;
+    size_t len;
+    int input; /* -1 marks the end of the stream */
+};
+
+struct ring
+{
+    struct ring_slot *slots;
+    int depth;
+    int head;  /* next slot the writer drains */
+    int tail;  /* next slot the reader fills, only the reader touches it */
+    int count; /* filled slots */
+    size_t buff_size;
+    pthread_mutex_t lock;
+    pthread_cond_t not_full;
+    pthread_cond_t not_empty;
+};
+
+struct pipe_job
+{
+    struct ring ring;
+    int fd_out;
+    char **infiles;
+    int cnt;
+    struct copy_stats *st;
+};
+
+/* blocks while the ring is full, that is the backpressure on the reader */
+static struct ring_slot *ring_get_free(struct ring *r)
+{
+    pthread_mutex_lock(&r->lock);
+    while (r->count == r->depth)
+        pthread_cond_wait(&r->not_full, &r->lock);
+    pthread_mutex_unlock(&r->lock);
+    /* only the reader fills slots, so this one stays free */
+    return &r->slots[r->tail];
+}
+
+static void ring_publish(struct ring *r, struct copy_stats *st)
+{
+    r->tail = (r->tail + 1) % r->depth;
+    pthread_mutex_lock(&r->lock);
+    r->count++;
+    if (st != NULL)
+        st->syscalls++; /* the read that filled the slot */
+    pthread_cond_signal(&r->not_empty);
+    pthread_mutex_unlock(&r->lock);
+}
+
+static void *reader(void *arg)
+{
+    struct pipe_job *job = arg;
+    struct ring *r = &job->ring;
+    struct ring_slot *slot;
+    ssize_t rcnt;
+
+    for (int i = 0; i < job->cnt; ++i)
+    {
+        int fd_in = open(job->infiles[i], O_RDONLY);
+
+        if (fd_in == -1)
+        {
+            perror("open error");
+            exit(1);
+        }
+        for (;;)
+        {
+            slot = ring_get_free(r);
+            rcnt = read(fd_in, slot->buff, r->buff_size);
+            if (rcnt == -1)
+            {
+                perror("read");
+                exit(1);
+            }
+            if (rcnt == 0)
+                break;
+            slot->len = rcnt;
+            slot->input = i;
+            ring_publish(r, &job->st[i]);
+        }
+        close(fd_in);
+        pthread_mutex_lock(&r->lock);
+        job->st[i].path = PATH_PIPELINE;
+        job->st[i].syscalls += 3; /* open, the read that saw EOF, close */
+        pthread_mutex_unlock(&r->lock);
+    }
+    slot = ring_get_free(r);
+    slot->len = 0;
+    slot->input = -1;
+    ring_publish(r, NULL);
+    return NULL;
+}
+
+static void *writer(void *arg)
+{
+    struct pipe_job *job = arg;
+    struct ring *r = &job->ring;
+    struct ring_slot *slot;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&r->lock);
+        while (r->count == 0)
+            pthread_cond_wait(&r->not_empty, &r->lock);
+        slot = &r->slots[r->head];
+        pthread_mutex_unlock(&r->lock);
+        if (slot->input == -1)
+            break;
+
+        /* only this thread touches the CRCs, no need for the lock */
+        crc_account(&job->st[slot->input], slot->buff, slot->len);
+        doWrite(job->fd_out, slot->buff, slot->len);
+
+        pthread_mutex_lock(&r->lock);
+        job->st[slot->input].bytes += slot->len;
+        job->st[slot->input].syscalls++;
+        r->head = (r->head + 1) % r->depth;
+        r->count--;
+        pthread_cond_signal(&r->not_full);
+        pthread_mutex_unlock(&r->lock);
+    }
+    return NULL;
+}
+
+void concat_pipeline(int fd_out, char **infiles, int cnt, int depth,
+                     size_t buff_size, struct copy_stats *st)
+{
+    struct pipe_job job;
+    struct ring *r = &job.ring;
+    pthread_t tr, tw;
+    int ret;
+
+    r->depth = depth;
+    r->head = 0;
+    r->tail = 0;
+    r->count = 0;
+    r->buff_size = buff_size > 0 ? buff_size : PIPE_BUFF_SIZE;
+    r->slots = malloc(depth * sizeof(*r->slots));
+    if (r->slots == NULL)
+    {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i < depth; ++i)
+    {
+        r->slots[i].buff = malloc(r->buff_size);
+        if (r->slots[i].buff == NULL)
+        {
+            perror("malloc");
+            exit(1);
+        }
+    }
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->not_full, NULL);
+    pthread_cond_init(&r->not_empty, NULL);
+    job.fd_out = fd_out;
+    job.infiles = infiles;
+    job.cnt = cnt;
+    job.st = st;
+
+    ret = pthread_create(&tr, NULL, reader, &job);
+    if (!ret)
+        ret = pthread_create(&tw, NULL, writer, &job);
+    if (ret)
+    {
+        perror_pthread(ret, "pthread_create");
+        exit(1);
+    }
+    pthread_join(tr, NULL);
+    pthread_join(tw, NULL);
+
+    pthread_cond_destroy(&r->not_empty);
+    pthread_cond_destroy(&r->not_full);
+    pthread_mutex_destroy(&r->lock);
+    for (int i = 0; i < depth; ++i)
+        free(r->slots[i].buff);
+    free(r->slots);
+}
@@ -0,0 +1,363 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "concat.h"
+
+/* size of each registered buffer, i.e. of each read/write pair */
+#define URING_BUFF_SIZE (256 << 10)
+/* inputs registered as fixed files at the same time */
+#define URING_FILE_BATCH 256
+
+/* the mapped submission and completion queues */
+struct uring
+{
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+};
+
+/* a registered buffer and the piece of input it is carrying */
+struct slot
+{
+    int busy;
+    int input;
+    off_t out_off;
+    unsigned len;  /* bytes asked from the input */
+    unsigned done; /* bytes already written out */
+};
+
+static int uring_setup(struct uring *r, unsigned entries)
+{
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd == -1)
+        return -1;
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sq_ptr == MAP_FAILED || r->cq_ptr == MAP_FAILED ||
+        r->sqes == MAP_FAILED)
+    {
+        perror("io_uring mmap");
+        exit(1);
+    }
+
+    r->sq_head = (unsigned *)((char *)r->sq_ptr + p.sq_off.head);
+    r->sq_tail = (unsigned *)((char *)r->sq_ptr + p.sq_off.tail);
+    r->sq_mask = (unsigned *)((char *)r->sq_ptr + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)((char *)r->sq_ptr + p.sq_off.array);
+    r->cq_head = (unsigned *)((char *)r->cq_ptr + p.cq_off.head);
+    r->cq_tail = (unsigned *)((char *)r->cq_ptr + p.cq_off.tail);
+    r->cq_mask = (unsigned *)((char *)r->cq_ptr + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)r->cq_ptr + p.cq_off.cqes);
+    return 0;
+}
+
+static void uring_exit(struct uring *r)
+{
+    munmap(r->sqes, r->sqes_len);
+    munmap(r->cq_ptr, r->cq_len);
+    munmap(r->sq_ptr, r->sq_len);
+    close(r->fd);
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct uring *r)
+{
+    unsigned tail = *r->sq_tail;
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+/* queues a fixed-buffer read or write, flags say if file is a registered one */
+static void uring_prep_rw(struct uring *r, int op, int file, int buf_index,
+                          void *addr, unsigned len, off_t off, int flags,
+                          __u64 user_data)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(r);
+
+    sqe->opcode = op;
+    sqe->flags = flags;
+    sqe->fd = file;
+    sqe->addr = (unsigned long)addr;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->buf_index = buf_index;
+    sqe->user_data = user_data;
+}
+
+static int uring_enter(struct uring *r, unsigned to_submit, unsigned wait)
+{
+    int ret;
+
+    do
+        ret = syscall(__NR_io_uring_enter, r->fd, to_submit, wait,
+                      wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    while (ret == -1 && errno == EINTR);
+    if (ret == -1)
+    {
+        perror("io_uring_enter");
+        exit(1);
+    }
+    return ret;
+}
+
+static void uring_register(struct uring *r, unsigned op, void *arg,
+                           unsigned nr)
+{
+    if (syscall(__NR_io_uring_register, r->fd, op, arg, nr) == -1)
+    {
+        perror("io_uring_register");
+        exit(1);
+    }
+}
+
+/*
+ * Copies inputs [first, first + nr) with up to depth linked read->write
+ * pairs in flight. Fixed file 0 is the output, file 1 + k is input first + k;
+ * where the files cannot be registered the plain descriptors are used.
+ */
+static void uring_copy_batch(struct uring *r, int fd_out, char **infiles,
+                             int first, int nr, off_t out_base, int depth,
+                             char **buffs, struct slot *slots,
+                             struct copy_stats *st)
+{
+    int *fds, input = first, inflight = 0, fixed, ff, busy;
+    off_t in_off = 0, *sizes;
+    unsigned queued = 0;
+    double *enters, sum = 0;
+    struct stat sin;
+
+    fds = malloc((nr + 1) * sizeof(*fds));
+    sizes = malloc(nr * sizeof(*sizes));
+    enters = calloc(nr, sizeof(*enters));
+    if (fds == NULL || sizes == NULL || enters == NULL)
+    {
+        perror("malloc");
+        exit(1);
+    }
+    fds[0] = fd_out;
+    for (int k = 0; k < nr; ++k)
+    {
+        fds[k + 1] = open(infiles[first + k], O_RDONLY);
+        if (fds[k + 1] == -1 || fstat(fds[k + 1], &sin) == -1)
+        {
+            perror(infiles[first + k]);
+            exit(1);
+        }
+        sizes[k] = sin.st_size;
+        st[first + k].path = PATH_URING;
+        st[first + k].syscalls += 2; /* open/close */
+    }
+    /* e.g. RLIMIT_NOFILE or an old kernel */
+    fixed = syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES, fds,
+                    nr + 1) != -1;
+    ff = fixed ? IOSQE_FIXED_FILE : 0;
+
+    for (;;)
+    {
+        /* fill every free slot with the next piece of input */
+        for (int s = 0; s < depth && input < first + nr; ++s)
+        {
+            if (slots[s].busy)
+                continue;
+            while (input < first + nr && in_off == sizes[input - first])
+            {
+                input++;
+                in_off = 0;
+            }
+            if (input == first + nr)
+                break;
+
+            slots[s].busy = 1;
+            slots[s].input = input;
+            slots[s].out_off = out_base + in_off;
+            slots[s].len = sizes[input - first] - in_off < URING_BUFF_SIZE
+                               ? sizes[input - first] - in_off
+                               : URING_BUFF_SIZE;
+            slots[s].done = 0;
+            uring_prep_rw(r, IORING_OP_READ_FIXED,
+                          fixed ? input - first + 1 : fds[input - first + 1],
+                          s, buffs[s], slots[s].len, in_off,
+                          ff | IOSQE_IO_LINK, (__u64)s << 1);
+            uring_prep_rw(r, IORING_OP_WRITE_FIXED, fixed ? 0 : fd_out, s,
+                          buffs[s], slots[s].len, slots[s].out_off, ff,
+                          (__u64)s << 1 | 1);
+            in_off += slots[s].len;
+            queued += 2;
+            inflight++;
+            if (in_off == sizes[input - first])
+                out_base += sizes[input - first];
+        }
+        if (inflight == 0)
+            break;
+
+        /* the call is shared by the inputs it submits or waits for */
+        busy = 0;
+        for (int s = 0; s < depth; ++s)
+            busy += slots[s].busy;
+        for (int s = 0; s < depth; ++s)
+            if (slots[s].busy)
+                enters[slots[s].input - first] += 1.0 / busy;
+        uring_enter(r, queued, 1);
+        queued = 0;
+
+        /* reap whatever has completed */
+        unsigned head = *r->cq_head;
+        while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+        {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            int s = cqe->user_data >> 1, is_write = cqe->user_data & 1;
+            struct slot *sl = &slots[s];
+
+            head++;
+            if (cqe->res < 0)
+            {
+                errno = -cqe->res;
+                perror(is_write ? "io_uring write" : "io_uring read");
+                exit(1);
+            }
+            if (!is_write)
+            {
+                /* a short read breaks the link, its write is cancelled */
+                if ((unsigned)cqe->res != sl->len)
+                {
+                    fprintf(stderr, "%s: input shrank while copying\n",
+                            infiles[sl->input]);
+                    exit(1);
+                }
+                continue;
+            }
+            sl->done += cqe->res;
+            if (sl->done < sl->len)
+            {
+                /* short write, send the rest on its own */
+                uring_prep_rw(r, IORING_OP_WRITE_FIXED, fixed ? 0 : fd_out, s,
+                              buffs[s] + sl->done, sl->len - sl->done,
+                              sl->out_off + sl->done, ff, (__u64)s << 1 | 1);
+                queued++;
+                continue;
+            }
+            st[sl->input].bytes += sl->len;
+            sl->busy = 0;
+            inflight--;
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    if (fixed)
+        uring_register(r, IORING_UNREGISTER_FILES, NULL, 0);
+    for (int k = 0; k < nr; ++k)
+        close(fds[k + 1]);
+    /* whole calls, rounded so that they still add up to the real count */
+    for (int k = 0; k < nr; ++k)
+    {
+        st[first + k].syscalls += (unsigned long)(sum + enters[k] + 0.5) -
+                                  (unsigned long)(sum + 0.5);
+        sum += enters[k];
+    }
+    free(enters);
+    free(sizes);
+    free(fds);
+}
+
+int concat_uring(int fd_out, char **infiles, int cnt, int depth,
+                 struct copy_stats *st)
+{
+    struct uring r;
+    struct stat sout, sin;
+    struct iovec *iov;
+    struct slot *slots;
+    char **buffs;
+    off_t out_base;
+
+    /* positional I/O only works between regular files */
+    if (fstat(fd_out, &sout) == -1 || !S_ISREG(sout.st_mode))
+        return -1;
+    for (int i = 0; i < cnt; ++i)
+        if (stat(infiles[i], &sin) == -1 || !S_ISREG(sin.st_mode))
+            return -1;
+    /* two entries per slot: the read and the write linked to it */
+    if (uring_setup(&r, 2 * depth) == -1)
+        return -1;
+
+    iov = malloc(depth * sizeof(*iov));
+    buffs = malloc(depth * sizeof(*buffs));
+    slots = calloc(depth, sizeof(*slots));
+    if (iov == NULL || buffs == NULL || slots == NULL)
+    {
+        perror("malloc");
+        exit(1);
+    }
+    for (int s = 0; s < depth; ++s)
+    {
+        if (posix_memalign((void **)&buffs[s], 4096, URING_BUFF_SIZE))
+        {
+            perror("posix_memalign");
+            exit(1);
+        }
+        iov[s].iov_base = buffs[s];
+        iov[s].iov_len = URING_BUFF_SIZE;
+    }
+    if (syscall(__NR_io_uring_register, r.fd, IORING_REGISTER_BUFFERS, iov,
+                depth) == -1)
+    {
+        /* e.g. RLIMIT_MEMLOCK too small on older kernels */
+        for (int s = 0; s < depth; ++s)
+            free(buffs[s]);
+        free(slots);
+        free(buffs);
+        free(iov);
+        uring_exit(&r);
+        return -1;
+    }
+
+    out_base = lseek(fd_out, 0, SEEK_CUR);
+    for (int i = 0; i < cnt; i += URING_FILE_BATCH)
+    {
+        int nr = cnt - i < URING_FILE_BATCH ? cnt - i : URING_FILE_BATCH;
+        uring_copy_batch(&r, fd_out, infiles, i, nr, out_base, depth, buffs,
+                         slots, st);
+        for (int k = i; k < i + nr; ++k)
+            out_base += st[k].bytes;
+    }
+    /* leave the output offset at its end, as the sequential copy does */
+    lseek(fd_out, out_base, SEEK_SET);
+
+    uring_register(&r, IORING_UNREGISTER_BUFFERS, NULL, 0);
+    for (int s = 0; s < depth; ++s)
+        free(buffs[s]);
+    free(slots);
+    free(buffs);
+    free(iov);
+    uring_exit(&r);
+    return 0;
+}
@@ -5,69 +5,42 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
 
-void doWrite(int fd, const char *buff, int len)
-{
-    int idx = 0;
-    int wcount = 0;
-    do
-    {
-        wcount = write(fd, buff + idx, len - idx);
-        if (wcount == -1)
-        { /* error */
-            perror("write");
-            exit(1);
-        }
-        idx += wcount;
-    } while (idx < len);
-}
+#include "concat.h"
 
-void write_file(int fd, const char *infile)
-{
-    char buff[1024];
-    ssize_t rcnt = 0, fd3;
-
-    fd3 = open(infile, O_RDONLY);
-    if (fd3 == -1)
-    {
-        perror("open error");
-        exit(1);
-    }
-    for (;;)
-    {
-        ssize_t temp_rcnt = 0;
-        rcnt += temp_rcnt = read(fd3, buff, sizeof(buff) - 1);
-        if (temp_rcnt == 0)
-            break;
-        if (rcnt == -1)
-        { /* error */
-            perror("read");
-            close(fd3);
-            exit(1);
-        }
-    }
-    buff[rcnt] = '\0';
-    close(fd3);
-    int len = strlen(buff);
-    doWrite(fd, buff, len);
-}
+static const char synopsis[] = "Usage: ./infconc [options] infile1 infile2 ... "
+                               "infileN outfile\n"
+                               "2 is the minimum number of infiles\n";
 
 int main(int argc, char **argv)
 {
+    struct concat_opts opts;
+    int first, bad = 0;
+
+    first = parse_concat_opts(argc, argv, synopsis, &opts);
+    argc -= first - 1;
+    argv += first - 1;
+
     if (argc <= 2)
     {
-        perror("Usage: ./fconc infile1 infile2 ... infileN [outfile (default:fconc.out)]");
-        printf("2 is the minimum number of infiles");
-        exit(1);
+        concat_usage(synopsis);
     }
     else
     {
-        int fd_out, oflags, mode;
-        oflags = O_CREAT | O_WRONLY | O_TRUNC | O_APPEND;
-        mode = S_IRUSR | S_IWUSR;
-        fd_out = open(argv[argc - 1], oflags, mode);
+        int fd_out, oflags, mode_bits, nr_in = argc - 2;
+        struct copy_stats *st;
+        struct timespec t0, t1;
 
-        if (fd_out == -1)
+        /* no O_APPEND: copy_file_range() refuses append-only outputs */
+        oflags = O_CREAT | O_WRONLY | O_TRUNC;
+        mode_bits = S_IRUSR | S_IWUSR;
+        /* -J writes outfile.part and renames it over outfile when done */
+        fd_out = -1;
+        if (!opts.journal)
+            fd_out = open(argv[argc - 1], oflags, mode_bits);
+
+        if (!opts.journal && fd_out == -1)
         {
             perror("Cannot open the output file");
             exit(1);
@@ -75,12 +48,36 @@ int main(int argc, char **argv)
         // If the file openned succesfully proceed to writing
         else
         {
-            for (int i = 1; i < argc-1;++i)
+            st = calloc(nr_in, sizeof(*st));
+            if (st == NULL)
+            {
+                perror("calloc");
+                exit(1);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            if (opts.journal)
+            {
+                concat_journaled(argv[argc - 1], argv + 1, nr_in, st, opts.verbose);
+            }
+            else
             {
-                write_file(fd_out, argv[i]);
+                concat_files(fd_out, argv + 1, nr_in, &opts, st);
+                close(fd_out);
             }
-            close(fd_out);
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            if (opts.verbose)
+                print_report(argv + 1, st, nr_in, argv[argc - 1],
+                             (t1.tv_sec - t0.tv_sec) +
+                                 (t1.tv_nsec - t0.tv_nsec) / 1e9);
+            fan_out(argv[argc - 1], opts.extras, opts.nr_extras, opts.verbose);
+            if (opts.manifest != NULL)
+                write_manifest(opts.manifest, argv + 1, st, nr_in, argv[argc - 1]);
+            if (opts.verify != NULL)
+                bad = verify_manifest(opts.verify, argv + 1, st, nr_in,
+                                      argv[argc - 1]);
+            free(st);
         }
     }
-    return 0;
+    free(opts.extras);
+    return bad ? 1 : 0;
 }
@@ -9,7 +9,6 @@
 #include "proc-common.h"
 
 #define SLEEP_PROC_SEC 10
-#define SLEEP_TREE_SEC 3
 
 /*
  * Create this process tree:
@@ -18,7 +17,8 @@
  */
 /**/
 
-void fork_procs(void)
+/* each process reports up a pipe once its subtree is ready, A on up */
+void fork_procs(int up)
 {
 	/*
 	 * initial process is A.
@@ -27,7 +27,9 @@ void fork_procs(void)
 	/* ... */
 
 	int statusA;
+	int readyA[2];
 	change_pname("A");
+	ready_pipe(readyA);
 	printf("Creating... B\n");
 
 	pid_t pA = fork();
@@ -39,7 +41,11 @@ void fork_procs(void)
 	if (pA == 0)
 	{
 		int statusB;
+		int readyB[2];
+		close(readyA[0]);
+		close(up);
 		change_pname("B");
+		ready_pipe(readyB);
 		printf("Creating... D\n");
 		pid_t pB = fork();
 		if (pB < 0)
@@ -49,12 +55,18 @@ void fork_procs(void)
 		}
 		if (pB == 0)
 		{
+			close(readyB[0]);
+			close(readyA[1]);
 			change_pname("D");
+			ready_notify(readyB[1]);
 			printf("D: Sleeping...\n");
 			sleep(SLEEP_PROC_SEC);
 			printf("D: Exiting...\n");
 			exit(13);
 		}
+		close(readyB[1]);
+		ready_wait(readyB[0], 1);
+		ready_notify(readyA[1]);
 		printf("B: Waiting...\n");
 		pB = wait(&statusB);
 		explain_wait_status(pB, statusB);
@@ -70,12 +82,18 @@ void fork_procs(void)
 	}
 	if (pA_2 == 0)
 	{
+		close(readyA[0]);
+		close(up);
 		change_pname("C");
+		ready_notify(readyA[1]);
 		printf("C: Sleeping...\n");
 		sleep(SLEEP_PROC_SEC);
 		printf("C: Exiting...\n");
 		exit(17);
 	}
+	close(readyA[1]);
+	ready_wait(readyA[0], 2);
+	ready_notify(up);
 	// A waiting for its 2 children
 	//	for (int i = 0; i < 2; ++i)
 	//{
@@ -94,8 +112,12 @@ int main()
 {
 	pid_t p;
 	int status;
+	int ready[2];
+	double start;
 	/* Fork root of process tree */
 	printf("Creating... A\n");
+	ready_pipe(ready);
+	start = clock_ms();
 	p = fork();
 	if (p < 0)
 	{
@@ -106,7 +128,8 @@ int main()
 	if (p == 0)
 	{
 		/* Child */
-		fork_procs();
+		close(ready[0]);
+		fork_procs(ready[1]);
 		exit(1);
 	}
 
@@ -114,7 +137,9 @@ int main()
 	 * Father
 	 */
 	/* for ask2-{fork, tree} */
-	sleep(SLEEP_TREE_SEC);
+	close(ready[1]);
+	ready_wait(ready[0], 1);
+	fprintf(stderr, "tree ready after %.3f ms\n", clock_ms() - start);
 
 	/* Print the process tree root at pid */
 
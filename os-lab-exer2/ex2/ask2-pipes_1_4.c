@@ -6,21 +6,75 @@
 #include <sys/wait.h>
 #include <string.h>
 #include <signal.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include "tree.h"
 #include "proc-common.h"
 
+/*
+ * With -d the tree is loaded as a DAG, and a subtree that occurs several
+ * times is computed by one process only. Its result goes into a memo in
+ * shared memory, one slot per shared children array, and every other
+ * occurrence takes it from there instead of forking. Its parent sleeps on
+ * a futex on the slot's state until the value is in.
+ */
+#define MEMO_FREE 0
+#define MEMO_CLAIMED 1
+#define MEMO_DONE 2
+
+struct memo
+{
+	int state;
+	int value;
+};
+
+struct memo_area
+{
+	int forks;
+	struct memo slot[];
+};
+
+static struct memo_area *memo; /* NULL without -d */
+static struct tree_node *dag_root;
+
+/* the memo of an inner node, which is that of its children array */
+static struct memo *memo_slot(struct tree_node *node)
+{
+	return &memo->slot[tree_child(node, 0) - dag_root];
+}
+
+/* a value another process has claimed, once it is there */
+static int memo_wait(struct memo *m)
+{
+	int state;
+
+	while ((state = __atomic_load_n(&m->state, __ATOMIC_ACQUIRE)) != MEMO_DONE)
+		syscall(SYS_futex, &m->state, FUTEX_WAIT, state, NULL, NULL, 0);
+	return m->value;
+}
+
+static void memo_done(struct memo *m, int value)
+{
+	m->value = value;
+	__atomic_store_n(&m->state, MEMO_DONE, __ATOMIC_RELEASE);
+	syscall(SYS_futex, &m->state, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
 void fork_procs(struct tree_node *root, int fd)
 {
 	int status;
-	change_pname(root->name);
-	printf("%s(%ld) is created...\n", root->name, (long)getpid());
+	if (memo != NULL)
+		__atomic_fetch_add(&memo->forks, 1, __ATOMIC_RELAXED);
+	change_pname(tree_node_name(root));
+	printf("%s(%ld) is created...\n", tree_node_name(root), (long)getpid());
 
 	// If the node is a leaf
 	if (root->nr_children == 0)
 	{
-		printf("The leaf node %s is created...\n", root->name);
-		int value = atoi(root->name);
+		printf("The leaf node %s is created...\n", tree_node_name(root));
+		int value = atoi(tree_node_name(root));
 		if (write(fd, &value, sizeof(value)) != sizeof(value))
 		{
 			perror("Leaf : write");
@@ -31,56 +85,77 @@ void fork_procs(struct tree_node *root, int fd)
 		exit(10);
 	}
 
-	int pfd[2];
+	int pfd[root->nr_children][2]; // a pipe per child, so values keep their order
 	pid_t pid[root->nr_children]; // pid[2] for us
-	printf("%s creating a pipe...\n", root->name);
-	if (pipe(pfd) < 0)
-	{
-		perror("pipe");
-		exit(1);
-	}
 	/*If the parent wants to receive data from the child, it should close pfd[1],
 	and the child should close pfd[0]. If the parent wants to send data to the child, it should close fd[0], and the child should close fd[1].
 	Since descriptors are shared between the parent and child, we should always be sure to close the end of pipe we aren't concerned with. On a technical note, the EOF will never be returned if the unnecessary ends of the pipe are not explicitly closed. */
 	int value[root->nr_children];
 	for (int i = 0; i < root->nr_children; ++i)
 	{
+		struct tree_node *child = tree_child(root, i);
+		pid[i] = 0;
+		if (memo != NULL && child->nr_children > 0)
+		{
+			struct memo *m = memo_slot(child);
+			int expected = MEMO_FREE;
+			if (!__atomic_compare_exchange_n(&m->state, &expected,
+							 MEMO_CLAIMED, 0,
+							 __ATOMIC_ACQ_REL,
+							 __ATOMIC_ACQUIRE))
+				continue; /* computed elsewhere, taken below */
+		}
+		printf("%s creating a pipe...\n", tree_node_name(root));
+		if (pipe(pfd[i]) < 0)
+		{
+			perror("pipe");
+			exit(1);
+		}
 		pid[i] = fork();
 		if (pid[i] < 0)
 		{
-			fprintf(stderr, "%s : fork\n", root->name);
+			fprintf(stderr, "%s : fork\n", tree_node_name(root));
 			exit(1);
 		}
 		if (pid[i] == 0)
 		{
-			close(pfd[0]);
-			fork_procs(root->children + i, pfd[1]);
+			for (int j = 0; j <= i; ++j)
+				if (j == i || pid[j] != 0)
+					close(pfd[j][0]);
+			fork_procs(child, pfd[i][1]);
 			exit(10);
 		}
+		close(pfd[i][1]);
 	}
-	close(pfd[1]);
 	for (int i = 0; i < root->nr_children; ++i)
 	{
-		if (read(pfd[0], &value[i], sizeof(value[i])) != sizeof(value[i]))
+		if (pid[i] == 0)
+		{
+			value[i] = memo_wait(memo_slot(tree_child(root, i)));
+			continue;
+		}
+		if (read(pfd[i][0], &value[i], sizeof(value[i])) != sizeof(value[i]))
 		{
 			perror("read");
 			exit(1);
 		}
+		close(pfd[i][0]);
 	}
 
-	close(pfd[0]);
 	int result;
-	if (!strcmp(root->name, "+"))
+	if (!strcmp(tree_node_name(root), "+"))
 	{
 		result = value[0] + value[1];
 		printf("Node %ld : %d + %d = %d\n", (long)getpid(), value[0], value[1], result);
 	}
 
-	if (!strcmp(root->name, "*"))
+	if (!strcmp(tree_node_name(root), "*"))
 	{
 		result = value[0] * value[1];
 		printf("Node %ld : %d * %d = %d\n", (long)getpid(), value[0], value[1], result);
 	}
+	if (memo != NULL)
+		memo_done(memo_slot(root), result);
 	if (write(fd, &result, sizeof(result)) != sizeof(result))
 	{ // write to parent
 		perror("write to pipe");
@@ -92,6 +167,8 @@ void fork_procs(struct tree_node *root, int fd)
 	// Let's wake up our children
 	for (int i = 0; i < root->nr_children; ++i)
 	{
+		if (pid[i] == 0)
+			continue; /* memoized */
 		kill(pid[i], SIGCONT);
 		pid[i] = wait(&status);
 		explain_wait_status(pid[i], status);
@@ -104,14 +181,22 @@ int main(int argc, char *argv[])
 {
 	pid_t pid;
 	int status;
-	struct tree_node *root;
-	if (argc != 2)
+	struct tree_node *root, *tree;
+	struct dag_stats stats;
+	int dag = argc == 3 && !strcmp(argv[1], "-d");
+	if (argc != 2 && !dag)
 	{
-		fprintf(stderr, "Usage: %s <input_tree_file>\n\n", argv[0]);
+		fprintf(stderr, "Usage: %s [-d] <input_tree_file>\n\n", argv[0]);
 		exit(1);
 	}
 
-	root = get_tree_from_file(argv[1]);
+	root = tree = get_tree_from_file(argv[argc - 1]);
+	if (dag)
+	{
+		root = dag_root = tree_to_dag(tree, &stats);
+		memo = create_shared_memory_area(sizeof(*memo) +
+						 stats.stored * sizeof(memo->slot[0]));
+	}
 	int pfd[2];
 	if (pipe(pfd) < 0)
 	{
@@ -160,6 +245,18 @@ int main(int argc, char *argv[])
 	}
 	explain_wait_status(pid, status);
 	printf("Done... Final result is: %d\n", value);
+	if (dag)
+	{
+		printf("DAG: %zu of %zu nodes stored (%.1f%% shared), "
+		       "%zu distinct subtrees, %zu of %zu bytes\n",
+		       stats.stored, stats.nodes,
+		       100.0 * (stats.nodes - stats.stored) / stats.nodes,
+		       stats.subtrees, stats.dag_bytes, stats.tree_bytes);
+		printf("DAG: %d of %zu processes forked\n", memo->forks,
+		       stats.nodes);
+		free_tree(root);
+	}
 
+	free_tree(tree);
 	return 0;
 }
\ No newline at end of file
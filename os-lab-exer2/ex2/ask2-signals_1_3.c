@@ -14,13 +14,13 @@ void fork_procs(struct tree_node *root)
 	/*
 	 * Start
 	 */
-	printf("PID = %ld, name %s, starting...\n",(long)getpid(), root->name);
-	change_pname(root->name);
+	printf("PID = %ld, name %s, starting...\n",(long)getpid(), tree_node_name(root));
+	change_pname(tree_node_name(root));
 	if(root->nr_children == 0)
 	{
-		printf("%s: Stoping...\n", root->name);
+		printf("%s: Stoping...\n", tree_node_name(root));
 	        raise(SIGSTOP);
-		printf("PID = %ld, name = %s is awake\n",(long)getpid(), root->name);		
+		printf("PID = %ld, name = %s is awake\n",(long)getpid(), tree_node_name(root));		
 		exit(20);
 	}
 	pid_t pid[root->nr_children]; // We create an array where the parent-process will save the children's pids
@@ -29,24 +29,24 @@ void fork_procs(struct tree_node *root)
 		pid[i] = fork();
 		if (pid[i] < 0)
 		{
-			fprintf(stderr, "%s : fork", root->name);
+			fprintf(stderr, "%s : fork", tree_node_name(root));
 			exit(1);
 		}
 		if (pid[i] == 0)
 		{
-			fork_procs(root->children + i);
+			fork_procs(tree_child(root, i));
 		}
 	}
 	/*........*/
-	printf("%s: Waiting for my children to stop...", root->name);
+	printf("%s: Waiting for my children to stop...", tree_node_name(root));
 	wait_for_ready_children(root->nr_children);
 	/*
 	 * Suspend Self
 	 */
-	printf("%s: Stoping...\n", root->name);
+	printf("%s: Stoping...\n", tree_node_name(root));
 	raise(SIGSTOP);
 	/* ... */
-	printf("PID = %ld, name = %s is awake\n",(long)getpid(), root->name);
+	printf("PID = %ld, name = %s is awake\n",(long)getpid(), tree_node_name(root));
 
         int status;
 	for (int i = 0; i < root->nr_children; ++i)
@@ -126,5 +126,6 @@ int main(int argc, char *argv[])
 	}
 	explain_wait_status(pid, status);
 
+	free_tree(root);
 	return 0;
 }
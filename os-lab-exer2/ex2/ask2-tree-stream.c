@@ -0,0 +1,199 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "tree.h"
+#include "proc-common.h"
+
+#define SLEEP_PROC_SEC 10
+
+/*
+ * Like ask2-tree, but the tree is never built: every process reads its
+ * own block from the stream, right where its parent stopped, and starts
+ * spawning its children straight away. When its subtree is spawned it
+ * sends the offset its parse ended at up a pipe, and its parent carries
+ * on from there with the next child. The first processes are up after
+ * the first few blocks are read, not after the whole file.
+ */
+
+static pid_t start_proc(struct tree_stream *ts, const char *name, int fds[2],
+		       int report);
+
+/*
+ * name is the one the parent's block gave this node, NULL for the root,
+ * which also reports on up (else -1) as soon as it is running
+ */
+void fork_procs(struct tree_stream *ts, const char *name, int report, int up)
+{
+	struct tree_block block;
+	pid_t pid;
+	int status;
+	int fds[2];
+	long pos;
+	int i;
+
+	/* name is in the parent's block, which reading this one overwrites */
+	if (name != NULL && (name = strdup(name)) == NULL)
+	{
+		perror("strdup");
+		exit(1);
+	}
+	if (!tree_stream_next(ts, &block))
+	{
+		fprintf(stderr, "expecting: %s and got EOF\n", name ? name : "root");
+		exit(1);
+	}
+	if (name != NULL && strcmp(name, block.name) != 0)
+	{
+		fprintf(stderr, "nodes must be placed in a DFS order\n");
+		fprintf(stderr, "expecting: %s and got: %s\n", name, block.name);
+		exit(1);
+	}
+	free((char *)name);
+	change_pname(block.name);
+	if (up >= 0)
+		ready_notify(up);
+
+	/* the children in order, each one parsing on from the last */
+	for (i = 0; i < block.nr_children; ++i)
+	{
+		if (pipe(fds) < 0)
+		{
+			perror("pipe");
+			exit(1);
+		}
+		start_proc(ts, block.children[i], fds, report);
+		close(fds[1]);
+		if (read(fds[0], &pos, sizeof(pos)) != sizeof(pos))
+		{
+			fprintf(stderr, "%s: child %s failed\n", block.name,
+				block.children[i]);
+			exit(1);
+		}
+		close(fds[0]);
+		tree_stream_seek(ts, pos);
+	}
+
+	/* the subtree is up, the parent can go on */
+	pos = tree_stream_tell(ts);
+	if (write(report, &pos, sizeof(pos)) != sizeof(pos))
+	{
+		perror("write");
+		exit(1);
+	}
+	close(report);
+
+	if (block.nr_children == 0) // if the process is leaf
+	{
+		printf("%s: Sleeping...\n", block.name);
+		sleep(SLEEP_PROC_SEC);
+		printf("%s: Exiting...\n", block.name);
+		exit(10);
+	}
+	printf("%s: Waiting...\n", block.name);
+	for (i = 0; i < block.nr_children; i++)
+	{
+		pid = wait(&status);
+		if (pid < 0)
+		{
+			perror("wait");
+			exit(1);
+		}
+		explain_wait_status(pid, status);
+	}
+	printf("%s : Exiting..\n", block.name);
+	exit(11);
+}
+
+/* forks the node called name, which parses on from ts and reports on fds */
+static pid_t start_proc(struct tree_stream *ts, const char *name, int fds[2],
+		       int report)
+{
+	pid_t pid;
+
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0)
+	{
+		fprintf(stderr, "%s : fork", name);
+		exit(1);
+	}
+	if (pid == 0)
+	{
+		close(fds[0]);
+		close(report);
+		fork_procs(ts, name, fds[1], -1);
+	}
+	return pid;
+}
+
+int main(int argc, char *argv[])
+{
+	struct tree_stream *ts;
+	double start, first;
+	pid_t pid;
+	int status;
+	int fds[2], up[2];
+	long pos;
+
+	if (argc != 2)
+	{
+		fprintf(stderr, "Usage: %s <input_tree_file>\n\n", argv[0]);
+		exit(1);
+	}
+
+	start = clock_ms();
+	ts = tree_stream_open(argv[1]);
+	if (pipe(fds) < 0)
+	{
+		perror("pipe");
+		exit(1);
+	}
+	ready_pipe(up);
+
+	/* Fork root of process tree */
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0)
+	{
+		perror("main: fork");
+		exit(1);
+	}
+	if (pid == 0)
+	{
+		close(fds[0]);
+		close(up[0]);
+		fork_procs(ts, NULL, fds[1], up[1]);
+		exit(1);
+	}
+	close(fds[1]);
+	close(up[1]);
+
+	/* the root is up as soon as it has read its own block */
+	ready_wait(up[0], 1);
+	first = clock_ms();
+
+	/* the root reports once the whole tree is spawned */
+	if (read(fds[0], &pos, sizeof(pos)) != sizeof(pos))
+	{
+		fprintf(stderr, "the process tree failed\n");
+		exit(1);
+	}
+	close(fds[0]);
+	fprintf(stderr, "first process after %.3f ms, tree ready after %.3f ms\n",
+		first - start, clock_ms() - start);
+
+	/* Print the process tree root at pid */
+
+	show_pstree(pid);
+
+	/* Wait for the root of the process tree to terminate */
+	pid = wait(&status);
+	explain_wait_status(pid, status);
+
+	tree_stream_close(ts);
+	return 0;
+}
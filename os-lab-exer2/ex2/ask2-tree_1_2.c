@@ -1,7 +1,9 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
@@ -9,7 +11,6 @@
 #include "proc-common.h"
 
 #define SLEEP_PROC_SEC 10
-#define SLEEP_TREE_SEC 3
 
 /*
  * Create this process tree:
@@ -17,45 +18,91 @@
  *   `-C
  */
 
-void fork_procs(struct tree_node *root)
+/*
+ * How the processes are started, see spawn_child(). With SPAWN_EXEC each
+ * one runs this program again as "--node <image> <index>": it maps the
+ * compiled image of the tree and carries on from node index, instead of
+ * inheriting the parsed tree and the rest of its parent's memory.
+ */
+static enum spawn_mode spawn_mode = SPAWN_FORK;
+static struct tree_node *tree_root;
+static char *tree_image;
+
+void fork_procs(struct tree_node *root, int up);
+
+/*
+ * Starts the process of node, which reports up on ready[1]; up is the
+ * parent's own, closed in a forked child, -1 if there is none.
+ */
+static pid_t start_proc(struct tree_node *node, int ready[2], int up,
+			int *pidfd)
+{
+	char idx[32];
+	char *args[] = { "ask2-tree_1_2", "--node", tree_image, idx, NULL };
+	pid_t pid;
+
+	snprintf(idx, sizeof(idx), "%ld", (long)(node - tree_root));
+	if (spawn_mode == SPAWN_EXEC)
+	{
+		/* the child gets ready[1] as SPAWN_FD, and no other pipe */
+		fcntl(ready[0], F_SETFD, FD_CLOEXEC);
+		fcntl(ready[1], F_SETFD, FD_CLOEXEC);
+	}
+	pid = spawn_child(spawn_mode, args, ready[1], pidfd);
+	if (pid == 0)
+	{
+		close(ready[0]);
+		if (up >= 0)
+			close(up);
+		fork_procs(node, ready[1]);
+	}
+	return pid;
+}
+
+/* up is where this node reports that its subtree is ready */
+void fork_procs(struct tree_node *root, int up)
 {
 	pid_t pid;
 	int status;
 	int i;
-	change_pname(root->name);
+	int ready[2];
+	change_pname(tree_node_name(root));
 
 	if (root->nr_children == 0) // if the process is leaf
 	{
-		printf("%s: Sleeping...\n", root->name);
+		ready_notify(up);
+		printf("%s: Sleeping...\n", tree_node_name(root));
 		sleep(SLEEP_PROC_SEC);
-		printf("%s: Exiting...\n", root->name);
+		printf("%s: Exiting...\n", tree_node_name(root));
 		exit(10);
 	}
+	int pidfd[root->nr_children];
+	pid_t pids[root->nr_children];
+	ready_pipe(ready);
 	for (i = 0; i < root->nr_children; ++i)
 	{
-		pid = fork();
+		pid = pids[i] = start_proc(tree_child(root, i), ready, up, &pidfd[i]);
 		if (pid < 0)
 		{
-			fprintf(stderr, "%s : fork", root->name);
+			fprintf(stderr, "%s : fork", tree_node_name(root));
 			exit(1);
 		}
-		if (pid == 0)
-		{
-			fork_procs(root->children + i);
-		}
 	}
-	printf("%s: Waiting...\n", root->name);
+	close(ready[1]);
+	ready_wait(ready[0], root->nr_children);
+	ready_notify(up);
+	printf("%s: Waiting...\n", tree_node_name(root));
 	for (int i = 0; i < root->nr_children; i++)
 	{
-		pid = wait(&status);
-		if (pid < -1)
+		pid = spawn_wait(pids[i], pidfd[i], &status);
+		if (pid < 0)
 		{
 			perror("wait");
 			exit(1);
 		}
 		explain_wait_status(pid, status);
 	}
-	printf("%s : Exiting..\n", root->name);
+	printf("%s : Exiting..\n", tree_node_name(root));
 	exit(11);
 }
 
@@ -68,7 +115,8 @@ void fork_procs(struct tree_node *root)
  *
  * How to wait for the process tree to be ready?
  * In ask2-{fork, tree}:
- *      wait for a few seconds, hope for the best.
+ *      every node reports up a pipe once its subtree is spawned,
+ *      see ready_pipe(), and the root reports to us.
  * In ask2-signals:
  *      use wait_for_ready_children() to wait until
  *      the first process raises SIGSTOP.
@@ -79,38 +127,78 @@ int main(int argc, char *argv[])
 	pid_t pid;
 	int status;
 	struct tree_node *root;
+	int ready[2];
+	int pidfd;
+	int fd;
+	int mode;
+	double start;
+
+	/* a node started by SPAWN_EXEC */
+	if (argc == 4 && !strcmp(argv[1], "--node"))
+	{
+		spawn_mode = SPAWN_EXEC;
+		tree_image = argv[2];
+		tree_root = get_tree_from_file(tree_image);
+		fork_procs(tree_root + atol(argv[3]), SPAWN_FD);
+	}
+	if (argc == 4 && !strcmp(argv[1], "-s") &&
+	    (mode = spawn_mode_parse(argv[2])) >= 0)
+	{
+		spawn_mode = mode;
+		argv[1] = argv[3];
+		argc = 2;
+	}
 	if (argc != 2)
 	{
-		fprintf(stderr, "Usage: %s <input_tree_file>\n\n", argv[0]);
+		fprintf(stderr, "Usage: %s [-s fork|clone3|exec] <input_tree_file>\n\n",
+			argv[0]);
 		exit(1);
 	}
 
-	root = get_tree_from_file(argv[1]);
+	root = tree_root = get_tree_from_file(argv[1]);
 	print_tree(root);
+	if (spawn_mode == SPAWN_EXEC)
+	{
+		/* the same arena, so node indices are the same in the image */
+		tree_image = strdup("/tmp/ask2-tree-XXXXXX");
+		fd = mkstemp(tree_image);
+		if (fd < 0)
+		{
+			perror("mkstemp");
+			exit(1);
+		}
+		close(fd);
+		save_tree_image(root, tree_image);
+	}
 
 	/* Fork root of process tree */
-	pid = fork();
+	ready_pipe(ready);
+	start = clock_ms();
+	pid = start_proc(root, ready, -1, &pidfd);
 	if (pid < 0)
 	{
 		perror("main: fork");
 		exit(1);
 	}
-	if (pid == 0)
-	{
-		fork_procs(root);
-		exit(1);
-	}
-
 
-	sleep(SLEEP_TREE_SEC);
+	close(ready[1]);
+	ready_wait(ready[0], 1);
+	fprintf(stderr, "tree ready after %.3f ms (%s)\n", clock_ms() - start,
+		spawn_mode_name(spawn_mode));
 
 	/* Print the process tree root at pid */
 
 	show_pstree(pid);
 
 	/* Wait for the root of the process tree to terminate */
-	pid = wait(&status);
+	pid = spawn_wait(pid, pidfd, &status);
 	explain_wait_status(pid, status);
 
+	if (tree_image != NULL)
+	{
+		unlink(tree_image);
+		free(tree_image);
+	}
+	free_tree(root);
 	return 0;
 }
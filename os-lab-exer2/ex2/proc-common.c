@@ -4,11 +4,17 @@
 #include <unistd.h>
 #include <assert.h>
 #include <string.h>
+#include <time.h>
+
+#include <errno.h>
+#include <spawn.h>
 
 #include <sys/types.h>
 #include <sys/prctl.h>
 #include <sys/wait.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/sched.h>
 
 #include "proc-common.h"
 
@@ -110,6 +116,210 @@ void wait_for_ready_children(int cnt)
 	}
 }
 
+/*
+ * Readiness barrier. A parent makes one pipe for all its children, and
+ * each child writes a byte to it once its own subtree is ready, so the
+ * report travels up the tree as fast as the processes are created.
+ */
+void ready_pipe(int fds[2])
+{
+	if (pipe(fds) < 0)
+	{
+		perror("ready_pipe: pipe");
+		exit(1);
+	}
+}
+
+void ready_notify(int fd)
+{
+	char c = 1;
+
+	if (write(fd, &c, 1) != 1)
+	{
+		perror("ready_notify: write");
+		exit(1);
+	}
+	close(fd);
+}
+
+void ready_wait(int fd, int cnt)
+{
+	char buf[64];
+	ssize_t n;
+
+	while (cnt > 0)
+	{
+		n = read(fd, buf, cnt < (int)sizeof(buf) ? cnt : (int)sizeof(buf));
+		if (n < 0)
+		{
+			perror("ready_wait: read");
+			exit(1);
+		}
+		if (n == 0)
+		{
+			fprintf(stderr, "ready_wait: a child died before it was ready\n");
+			exit(1);
+		}
+		cnt -= n;
+	}
+	close(fd);
+}
+
+double clock_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/*
+ * Process spawning backends.
+ */
+static const char *spawn_names[] = { "fork", "clone3", "exec" };
+
+int spawn_mode_parse(const char *name)
+{
+	for (int m = 0; m < (int)(sizeof(spawn_names) / sizeof(spawn_names[0])); m++)
+		if (!strcmp(name, spawn_names[m]))
+			return m;
+	return -1;
+}
+
+const char *spawn_mode_name(enum spawn_mode mode)
+{
+	return spawn_names[mode];
+}
+
+/*
+ * The pidfds this process holds. The kernel makes them close-on-exec,
+ * but a clone3() child without an exec would inherit its older
+ * siblings' ones, so it closes them first thing.
+ */
+static int *pidfds;
+static int nr_pidfds, max_pidfds;
+
+static void pidfd_add(int pidfd)
+{
+	if (nr_pidfds == max_pidfds)
+	{
+		max_pidfds = max_pidfds ? 2 * max_pidfds : 16;
+		pidfds = realloc(pidfds, max_pidfds * sizeof(*pidfds));
+		if (pidfds == NULL)
+		{
+			perror("realloc");
+			exit(1);
+		}
+	}
+	pidfds[nr_pidfds++] = pidfd;
+}
+
+static void pidfd_del(int pidfd)
+{
+	for (int i = 0; i < nr_pidfds; i++)
+		if (pidfds[i] == pidfd)
+		{
+			pidfds[i] = pidfds[--nr_pidfds];
+			break;
+		}
+}
+
+/* set once clone3() turns out to be missing or forbidden */
+static int clone3_broken;
+
+/*
+ * clone3() with fork() semantics and a pidfd. It goes around glibc, so
+ * no atfork handlers run: fine for these single threaded programs.
+ * Where the kernel lacks clone3() or a seccomp filter refuses it, this
+ * is plain fork() without a pidfd.
+ */
+static pid_t spawn_clone3(int *pidfd)
+{
+	struct clone_args args;
+	pid_t pid;
+
+	if (clone3_broken)
+		return fork();
+	memset(&args, 0, sizeof(args));
+	args.flags = CLONE_PIDFD;
+	args.pidfd = (unsigned long)pidfd;
+	args.exit_signal = SIGCHLD;
+	pid = syscall(SYS_clone3, &args, sizeof(args));
+	if (pid < 0 && (errno == ENOSYS || errno == EPERM))
+	{
+		clone3_broken = 1;
+		*pidfd = -1;
+		return fork();
+	}
+	if (pid == 0)
+	{
+		for (int i = 0; i < nr_pidfds; i++)
+			close(pidfds[i]);
+		nr_pidfds = 0;
+	}
+	else if (pid > 0)
+		pidfd_add(*pidfd);
+	return pid;
+}
+
+/*
+ * posix_spawn() shares the parent's memory until the exec, instead of
+ * copying its page tables, so its cost does not grow with the parent.
+ */
+static pid_t spawn_exec(char *const argv[], int fd)
+{
+	posix_spawn_file_actions_t fa;
+	extern char **environ;
+	pid_t pid;
+	int ret;
+
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_adddup2(&fa, fd, SPAWN_FD);
+	ret = posix_spawn(&pid, "/proc/self/exe", &fa, NULL, argv, environ);
+	posix_spawn_file_actions_destroy(&fa);
+	if (ret != 0)
+	{
+		errno = ret;
+		return -1;
+	}
+	return pid;
+}
+
+pid_t spawn_child(enum spawn_mode mode, char *const argv[], int fd, int *pidfd)
+{
+	*pidfd = -1;
+	switch (mode)
+	{
+	case SPAWN_CLONE3:
+		return spawn_clone3(pidfd);
+	case SPAWN_EXEC:
+		return spawn_exec(argv, fd);
+	default:
+		return fork();
+	}
+}
+
+pid_t spawn_wait(pid_t pid, int pidfd, int *status)
+{
+	siginfo_t info;
+
+	/* not wait(): that could reap a sibling a pidfd still tracks */
+	if (pidfd < 0)
+		return waitpid(pid, status, 0);
+	memset(&info, 0, sizeof(info));
+	if (waitid(P_PIDFD, pidfd, &info, WEXITED) < 0)
+		return -1;
+	pidfd_del(pidfd);
+	close(pidfd);
+	if (info.si_code == CLD_EXITED)
+		*status = W_EXITCODE(info.si_status, 0);
+	else if (info.si_code == CLD_DUMPED)
+		*status = W_EXITCODE(0, info.si_status) | WCOREFLAG;
+	else
+		*status = W_EXITCODE(0, info.si_status);
+	return info.si_pid;
+}
+
 /*
  * Print the process tree rooted at process with PID p.
  */
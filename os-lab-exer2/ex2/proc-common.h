@@ -25,6 +25,42 @@ void explain_wait_status(pid_t pid, int status);
  */
 void wait_for_ready_children(int cnt);
 
+/*
+ * Readiness barrier, in place of sleeping and hoping the tree is there:
+ * a parent makes one pipe with ready_pipe() before forking its children,
+ * each child calls ready_notify() on the write end once it and its whole
+ * subtree are up, and the parent closes its copy of the write end and
+ * calls ready_wait() for that many children before reporting up itself.
+ * ready_wait() exits if a child dies first.
+ */
+void ready_pipe(int fds[2]);
+void ready_notify(int fd);
+void ready_wait(int fd, int cnt);
+
+/* A monotonic clock in milliseconds, to time the tree. */
+double clock_ms(void);
+
+/*
+ * Process spawning backends:
+ *   SPAWN_FORK    fork()
+ *   SPAWN_CLONE3  clone3() with CLONE_PIDFD, otherwise like fork(), and
+ *                 fork() itself where clone3() is missing or refused
+ *   SPAWN_EXEC    posix_spawn() of this program again, with argv; the
+ *                 child starts from scratch instead of inheriting the
+ *                 parent's memory, and finds fd as SPAWN_FD
+ * spawn_child() returns 0 in the child for the first two, like fork(),
+ * and fills in *pidfd, -1 without one. spawn_wait() waits for that
+ * child by its pidfd, or by its pid when there is none.
+ */
+enum spawn_mode { SPAWN_FORK, SPAWN_CLONE3, SPAWN_EXEC };
+
+#define SPAWN_FD 3
+
+int spawn_mode_parse(const char *name); /* -1 for an unknown name */
+const char *spawn_mode_name(enum spawn_mode mode);
+pid_t spawn_child(enum spawn_mode mode, char *const argv[], int fd, int *pidfd);
+pid_t spawn_wait(pid_t pid, int pidfd, int *status);
+
 /* Change the name of the process. */
 void change_pname(const char *new_name);
 
@@ -0,0 +1,244 @@
+/*
+ * spawn-bench.c
+ *
+ * Times spawning the process tree of each given .tree file with each
+ * spawn backend, while the initial process holds a growing amount of
+ * resident memory, and prints one CSV line per file, size and backend.
+ * The time is until the root reports the whole tree ready, so it is the
+ * cost of creating the processes and not of tearing them down.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "tree.h"
+#include "proc-common.h"
+
+#define MAX_SIZES 16
+
+static enum spawn_mode spawn_mode;
+static struct tree_node *tree_root;
+static char *tree_image;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: ./spawn-bench [-r reps] [-m MB,MB,...] "
+			"[-s fork,clone3,exec] file.tree ...\n"
+			"  -m  resident memory the initial process holds, "
+			"default 0,256\n"
+			"  -s  the spawn backends, default all of them\n");
+	exit(1);
+}
+
+static void run_node(struct tree_node *node, int up);
+
+/* as in ask2-tree_1_2, with "--node <image> <index>" for SPAWN_EXEC */
+static pid_t
+start_node(struct tree_node *node, int ready[2], int up, int *pidfd)
+{
+	char idx[32];
+	char *args[] = { "spawn-bench", "--node", tree_image, idx, NULL };
+	pid_t pid;
+
+	snprintf(idx, sizeof(idx), "%ld", (long)(node - tree_root));
+	if (spawn_mode == SPAWN_EXEC){
+		fcntl(ready[0], F_SETFD, FD_CLOEXEC);
+		fcntl(ready[1], F_SETFD, FD_CLOEXEC);
+	}
+	pid = spawn_child(spawn_mode, args, ready[1], pidfd);
+	if (pid < 0){
+		perror("spawn");
+		exit(1);
+	}
+	if (pid == 0){
+		close(ready[0]);
+		if (up >= 0)
+			close(up);
+		run_node(node, ready[1]);
+	}
+	return pid;
+}
+
+/* spawns the subtree, reports it ready and goes away with it */
+static void
+run_node(struct tree_node *node, int up)
+{
+	int ready[2], status;
+
+	if (node->nr_children == 0){
+		ready_notify(up);
+		_exit(0);
+	}
+	int pidfd[node->nr_children];
+	pid_t pid[node->nr_children];
+	ready_pipe(ready);
+	for (unsigned i = 0; i < node->nr_children; i++)
+		pid[i] = start_node(tree_child(node, i), ready, up, &pidfd[i]);
+	close(ready[1]);
+	ready_wait(ready[0], node->nr_children);
+	ready_notify(up);
+	for (unsigned i = 0; i < node->nr_children; i++)
+		spawn_wait(pid[i], pidfd[i], &status);
+	_exit(0);
+}
+
+/* milliseconds until the whole tree is up */
+static double
+spawn_tree(void)
+{
+	int ready[2], pidfd, status;
+	double t;
+	pid_t pid;
+
+	ready_pipe(ready);
+	fflush(stdout);
+	t = clock_ms();
+	pid = start_node(tree_root, ready, -1, &pidfd);
+	close(ready[1]);
+	ready_wait(ready[0], 1);
+	t = clock_ms() - t;
+	if (spawn_wait(pid, pidfd, &status) != pid || !WIFEXITED(status)){
+		fprintf(stderr, "the process tree failed\n");
+		exit(1);
+	}
+	return t;
+}
+
+static long
+resident_kb(void)
+{
+	long size, resident = 0;
+	FILE *file;
+
+	file = fopen("/proc/self/statm", "r");
+	if (file != NULL){
+		if (fscanf(file, "%ld %ld", &size, &resident) != 2)
+			resident = 0;
+		fclose(file);
+	}
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void
+bench_file(const char *filename, long *sizes, int nr_sizes, int *modes,
+	   int nr_modes, int reps)
+{
+	struct flat_tree *ft;
+	size_t nodes, len;
+	double best, t;
+	void *ballast;
+	int fd;
+
+	tree_root = get_tree_from_file(filename);
+	if (tree_root == NULL){
+		fprintf(stderr, "%s: empty tree\n", filename);
+		exit(1);
+	}
+	ft = flat_tree_from_nodes(tree_root);
+	nodes = flat_tree_count(ft);
+	free_flat_tree(ft);
+
+	tree_image = strdup("/tmp/spawn-bench-XXXXXX");
+	fd = mkstemp(tree_image);
+	if (fd < 0){
+		perror("mkstemp");
+		exit(1);
+	}
+	close(fd);
+	save_tree_image(tree_root, tree_image);
+
+	for (int s = 0; s < nr_sizes; s++){
+		/* touched, so it is resident and every fork copies its tables */
+		len = sizes[s] << 20;
+		ballast = NULL;
+		if (len > 0){
+			ballast = mmap(NULL, len, PROT_READ | PROT_WRITE,
+				       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (ballast == MAP_FAILED){
+				perror("mmap");
+				exit(1);
+			}
+			memset(ballast, 1, len);
+		}
+		for (int m = 0; m < nr_modes; m++){
+			spawn_mode = modes[m];
+			best = 0;
+			for (int r = 0; r < reps; r++){
+				t = spawn_tree();
+				if (r == 0 || t < best)
+					best = t;
+			}
+			printf("%s,%zu,%s,%ld,%.3f,%.3f\n", filename, nodes,
+			       spawn_mode_name(spawn_mode), resident_kb(), best,
+			       best * 1e3 / nodes);
+			fflush(stdout);
+		}
+		if (ballast != NULL)
+			munmap(ballast, len);
+	}
+
+	unlink(tree_image);
+	free(tree_image);
+	free_tree(tree_root);
+}
+
+int main(int argc, char *argv[])
+{
+	int modes[] = { SPAWN_FORK, SPAWN_CLONE3, SPAWN_EXEC }, nr_modes = 3;
+	long sizes[MAX_SIZES] = { 0, 256 };
+	int nr_sizes = 2, opt, reps = 3, m;
+	char *tok;
+
+	/* a node started by SPAWN_EXEC */
+	if (argc == 4 && !strcmp(argv[1], "--node")){
+		spawn_mode = SPAWN_EXEC;
+		tree_image = argv[2];
+		tree_root = get_tree_from_file(tree_image);
+		run_node(tree_root + atol(argv[3]), SPAWN_FD);
+	}
+
+	while ((opt = getopt(argc, argv, "r:m:s:")) != -1){
+		switch (opt){
+		case 'r':
+			reps = atoi(optarg);
+			if (reps <= 0)
+				usage();
+			break;
+		case 'm':
+			nr_sizes = 0;
+			for (tok = strtok(optarg, ","); tok != NULL;
+			     tok = strtok(NULL, ",")){
+				if (nr_sizes == MAX_SIZES || atol(tok) < 0)
+					usage();
+				sizes[nr_sizes++] = atol(tok);
+			}
+			break;
+		case 's':
+			nr_modes = 0;
+			for (tok = strtok(optarg, ","); tok != NULL;
+			     tok = strtok(NULL, ",")){
+				m = spawn_mode_parse(tok);
+				if (m < 0 || nr_modes == 3)
+					usage();
+				modes[nr_modes++] = m;
+			}
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind == argc || nr_sizes == 0 || nr_modes == 0)
+		usage();
+
+	printf("file,nodes,mode,parent_rss_kb,ms,us_per_node\n");
+	for (int i = optind; i < argc; i++)
+		bench_file(argv[i], sizes, nr_sizes, modes, nr_modes, reps);
+	return 0;
+}
@@ -0,0 +1,678 @@
+/*
+ * tree-bench.c
+ *
+ * Times the parser this tree started with, the tree parser with its stdio
+ * and its mmap backend, the streaming parser with a callback that does
+ * nothing, the loading of the compiled image, hash-consing into a DAG
+ * (whose sharing goes to stderr), print_tree(), print_tree_fd() and
+ * flat_print_tree(), and a count and depth walk on both the node tree and
+ * the flat tree, on the given .tree files, and on a chain or a star of
+ * generated nodes, and prints one CSV line per file and step. Parse steps
+ * also report how far the RSS of a fresh process that does only that step
+ * peaks above where it started.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "tree.h"
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: ./tree-bench [-r reps] [-D depth] [-W width] "
+			"[file.tree ...]\n"
+			"  -D depth  also run a generated chain of depth levels\n"
+			"  -W width  also run a generated root with width leaves\n");
+	exit(1);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* the fgets() backend of get_tree_from_file(), not the old parser */
+static struct tree_node *
+parse_stdio(const char *filename)
+{
+	struct tree_node *root;
+	FILE *file;
+
+	file = fopen(filename, "r");
+	if (file == NULL){
+		perror(filename);
+		exit(1);
+	}
+	root = get_tree_from_stream(file);
+	fclose(file);
+	return root;
+}
+
+/*
+ * The parser as it was before the arena: fgets() into a 1024 byte
+ * buffer, strlen() and snprintf() on every line and a calloc() or
+ * malloc() per node, names cut to 15 characters. Kept here only as the
+ * baseline of the "legacy" step.
+ */
+#define LEGACY_BUFF_SIZE 1024
+#define LEGACY_NAME_SIZE 16
+
+struct legacy_node {
+	unsigned           nr_children;
+	char               name[LEGACY_NAME_SIZE];
+	struct legacy_node *children;
+};
+
+static char *
+legacy_read_line(FILE *file, char *buff, size_t buff_size)
+{
+	char *ret;
+	size_t ret_len;
+
+	ret = fgets(buff, buff_size, file);
+
+	/* sanity check */
+	if (ret == NULL){
+		return ret;
+	}
+
+	ret_len = strlen(ret);
+	if (ret_len == buff_size - 1){
+		fprintf(stderr, "line too long: %s\n", buff);
+		exit(1);
+	}
+
+	if (ret_len > 0)
+		buff[ret_len - 1] = '\0'; /* remove \n */
+
+	return ret;
+}
+
+static char *
+legacy_read_empty_line(FILE *file, char *buff, size_t buff_size)
+{
+	char *ret;
+	ret = legacy_read_line(file, buff, buff_size);
+	if (ret != NULL && strlen(ret) != 0){
+		fprintf(stderr, "expecting an empty line: %s", buff);
+		exit(1);
+	}
+
+	return ret;
+}
+
+static char *
+legacy_read_non_empty_line(FILE *file, char *buff, size_t buff_size)
+{
+	char *ret;
+	ret = legacy_read_line(file, buff, buff_size);
+
+	if (ret == NULL){
+		fprintf(stderr, "unexpected EOF\n");
+		exit(1);
+	}
+
+	if (strlen(ret) == 0){
+		fprintf(stderr, "Unexpected empty line\n");
+		exit(1);
+	}
+
+	return ret;
+}
+
+static char *
+legacy_find_block_start(FILE *file, char *buff, size_t buff_size)
+{
+	char *line;
+	for (;;){
+		line = legacy_read_line(file, buff, buff_size);
+		if (line == NULL) /* EOF */
+			break;
+		if (strlen(line) == 0 || line[0] == '#')
+			continue;  /* comment or empty line */
+		else
+			break;
+	}
+
+	return line;
+}
+
+static struct legacy_node *
+legacy_parse_node(FILE *file, struct legacy_node *node)
+{
+	char buff[LEGACY_BUFF_SIZE], *name, *num_str;
+	unsigned nr_children;
+	int i;
+
+	name = legacy_find_block_start(file, buff, LEGACY_BUFF_SIZE);
+	if (name == NULL){ /* EOF */
+		 /* empty file, do nothing */
+		if (node == NULL)
+			return NULL;
+		/* otherwise, terminate parsing */
+		fprintf(stderr, "expecting: %s and got EOF\n", node->name);
+		exit(1);
+	}
+
+	/* If no node given, allocate one -- this is used for root
+	 * If node is given, check that the names match */
+	if (node == NULL){
+		node = calloc(1, sizeof(struct legacy_node));
+		if (node == NULL){
+			fprintf(stderr, "node allocation failed\n");
+			exit(1);
+		}
+		snprintf(node->name, LEGACY_NAME_SIZE, "%s", name);
+	} else if (strncmp(node->name, name, LEGACY_NAME_SIZE) != 0){
+		fprintf(stderr, "nodes must be placed in a DFS order\n");
+		fprintf(stderr, "expecting: %s and got: %s\n", node->name, name);
+		exit(1);
+	}
+
+	/* read number of children */
+	num_str = legacy_read_non_empty_line(file, buff, LEGACY_BUFF_SIZE);
+	nr_children = node->nr_children = atol(num_str);
+
+	/* allocate children */
+	if (nr_children != 0){
+		node->children = malloc(sizeof(struct legacy_node)*nr_children);
+		if (node->children == NULL){
+			fprintf(stderr, "allocate children failed\n");
+			exit(1);
+		}
+	}
+
+	/* read children names */
+	for (i=0; i<nr_children; i++){
+		name = legacy_read_non_empty_line(file, buff, LEGACY_BUFF_SIZE);
+		snprintf(node->children[i].name, LEGACY_NAME_SIZE, "%s", name);
+	}
+
+	legacy_read_empty_line(file, buff, LEGACY_BUFF_SIZE);
+
+	/* parse children */
+	for (i=0; i<nr_children; i++){
+		legacy_parse_node(file, &node->children[i]);
+	}
+
+	return node;
+}
+
+static struct legacy_node *
+legacy_parse(const char *filename)
+{
+	struct legacy_node *root;
+	FILE *file;
+
+	file = fopen(filename, "r");
+	if (file == NULL){
+		perror(filename);
+		exit(1);
+	}
+	root = legacy_parse_node(file, NULL);
+	fclose(file);
+	return root;
+}
+
+/* the old tree had no free, this is the obvious one */
+static void
+legacy_free(struct legacy_node *node, int is_root)
+{
+	if (node == NULL)
+		return;
+	/* children of a leaf is never set, but for the root's calloc() */
+	if (node->nr_children == 0){
+		if (is_root)
+			free(node);
+		return;
+	}
+	for (unsigned i = 0; i < node->nr_children; i++)
+		legacy_free(&node->children[i], 0);
+	free(node->children);
+	if (is_root)
+		free(node);
+}
+
+/* legacy_parse(), best of reps */
+static double
+time_legacy(const char *filename, int reps)
+{
+	struct legacy_node *root;
+	double best = 0, t;
+
+	for (int r = 0; r < reps; r++){
+		t = now();
+		root = legacy_parse(filename);
+		t = now() - t;
+		legacy_free(root, 1);
+		if (r == 0 || t < best)
+			best = t;
+	}
+	return best;
+}
+
+/* best of reps runs, so a cold first run does not count */
+static double
+time_parse(struct tree_node *(*parse)(const char *), const char *filename,
+	   int reps)
+{
+	struct tree_node *root;
+	double best = 0, t;
+
+	for (int r = 0; r < reps; r++){
+		t = now();
+		root = parse(filename);
+		t = now() - t;
+		free_tree(root);
+		if (r == 0 || t < best)
+			best = t;
+	}
+	return best;
+}
+
+static int
+count_block(const struct tree_block *block, unsigned depth, void *arg)
+{
+	(*(long *)arg)++;
+	return 0;
+}
+
+/* tree_for_each_block() alone, best of reps */
+static double
+time_stream(const char *filename, int reps)
+{
+	double best = 0, t;
+	long blocks;
+
+	for (int r = 0; r < reps; r++){
+		blocks = 0;
+		t = now();
+		tree_for_each_block(filename, count_block, &blocks);
+		t = now() - t;
+		if (r == 0 || t < best)
+			best = t;
+	}
+	return best;
+}
+
+enum print_how { PRINT_STDIO, PRINT_FD, PRINT_FLAT };
+
+/* one of the printers into /dev/null, best of reps */
+static double
+time_print(const char *filename, int reps, enum print_how how)
+{
+	struct tree_node *root = get_tree_from_file(filename);
+	struct flat_tree *ft = how == PRINT_FLAT ? flat_tree_from_nodes(root)
+						 : NULL;
+	double best = 0, t;
+	int saved, null;
+
+	fflush(stdout);
+	saved = dup(STDOUT_FILENO);
+	null = open("/dev/null", O_WRONLY);
+	if (saved == -1 || null == -1){
+		perror("/dev/null");
+		exit(1);
+	}
+	dup2(null, STDOUT_FILENO);
+	for (int r = 0; r < reps; r++){
+		t = now();
+		if (how == PRINT_FLAT)
+			flat_print_tree(ft);
+		else if (how == PRINT_FD)
+			print_tree_fd(root, STDOUT_FILENO);
+		else
+			print_tree(root);
+		fflush(stdout);
+		t = now() - t;
+		if (r == 0 || t < best)
+			best = t;
+	}
+	dup2(saved, STDOUT_FILENO);
+	close(saved);
+	close(null);
+	free_flat_tree(ft);
+	free_tree(root);
+	return best;
+}
+
+/* tree_to_dag() of a loaded tree, best of reps */
+static double
+time_dag(const char *filename, int reps)
+{
+	struct tree_node *root = get_tree_from_file(filename), *dag;
+	struct dag_stats st;
+	double best = 0, t;
+
+	for (int r = 0; r < reps; r++){
+		t = now();
+		dag = tree_to_dag(root, &st);
+		t = now() - t;
+		free_tree(dag);
+		if (r == 0 || t < best)
+			best = t;
+	}
+	fprintf(stderr, "%s: DAG stores %zu of %zu nodes, %zu of %zu bytes\n",
+		filename, st.stored, st.nodes, st.dag_bytes, st.tree_bytes);
+	free_tree(root);
+	return best;
+}
+
+struct walk_frame {
+	struct tree_node *node;
+	unsigned level;
+};
+
+/* the node tree way to flat_tree_count() and flat_tree_depth(): a DFS */
+static void
+walk_tree(struct tree_node *root, size_t *count, unsigned *depth)
+{
+	struct walk_frame *stack;
+	size_t top = 0, cap = 1024;
+	struct walk_frame f;
+
+	stack = malloc(cap * sizeof(*stack));
+	if (stack == NULL){
+		perror("malloc");
+		exit(1);
+	}
+	*count = 0;
+	*depth = 0;
+	stack[top++] = (struct walk_frame){ root, 1 };
+	while (top > 0){
+		f = stack[--top];
+		(*count)++;
+		if (f.level > *depth)
+			*depth = f.level;
+		if (top + f.node->nr_children > cap){
+			while (top + f.node->nr_children > cap)
+				cap *= 2;
+			stack = realloc(stack, cap * sizeof(*stack));
+			if (stack == NULL){
+				perror("realloc");
+				exit(1);
+			}
+		}
+		for (unsigned i = 0; i < f.node->nr_children; i++)
+			stack[top++] = (struct walk_frame){ tree_child(f.node, i),
+							    f.level + 1 };
+	}
+	free(stack);
+}
+
+/* count and depth of the node tree or the flat tree, best of reps */
+static double
+time_walk(const char *filename, int reps, int flat)
+{
+	struct tree_node *root = get_tree_from_file(filename);
+	struct flat_tree *ft = flat_tree_from_nodes(root);
+	size_t count, flat_count;
+	unsigned depth, flat_depth;
+	double best = 0, t;
+
+	walk_tree(root, &count, &depth);
+	flat_count = flat_tree_count(ft);
+	flat_depth = flat_tree_depth(ft);
+	if (count != flat_count || depth != flat_depth){
+		fprintf(stderr, "%s: flat tree has %zu nodes and %u levels, "
+				"not %zu and %u\n", filename, flat_count,
+				flat_depth, count, depth);
+		exit(1);
+	}
+	for (int r = 0; r < reps; r++){
+		t = now();
+		if (flat){
+			count = flat_tree_count(ft);
+			depth = flat_tree_depth(ft);
+		} else {
+			walk_tree(root, &count, &depth);
+		}
+		t = now() - t;
+		if (r == 0 || t < best)
+			best = t;
+	}
+	free_flat_tree(ft);
+	free_tree(root);
+	return best;
+}
+
+/* n0 -> n1 -> ... with depth levels, or a root with width leaves */
+static char *
+generate(const char *shape, long n)
+{
+	char *name = strdup("/tmp/tree-bench-XXXXXX");
+	FILE *file;
+	int fd;
+
+	fd = mkstemp(name);
+	if (fd == -1 || (file = fdopen(fd, "w")) == NULL){
+		perror("mkstemp");
+		exit(1);
+	}
+	if (shape[0] == 'd'){
+		for (long i = 0; i < n - 1; i++)
+			fprintf(file, "n%ld\n1\nn%ld\n\n", i, i + 1);
+		fprintf(file, "n%ld\n0\n", n - 1);
+	} else {
+		fprintf(file, "root\n%ld\n", n);
+		for (long i = 0; i < n; i++)
+			fprintf(file, "c%ld\n", i);
+		for (long i = 0; i < n; i++)
+			fprintf(file, "\nc%ld\n0\n", i);
+	}
+	if (fclose(file) == EOF){
+		perror(name);
+		exit(1);
+	}
+	return name;
+}
+
+/* peak_kb is left empty when it is below 0 */
+static void
+report(const char *label, off_t bytes, const char *step, double t,
+       long peak_kb)
+{
+	printf("%s,%lld,%s,%.6f,%.3f,", label, (long long)bytes, step, t,
+	       bytes ? t * 1e3 / (bytes / 1048576.0) : 0);
+	if (peak_kb >= 0)
+		printf("%ld", peak_kb);
+	printf("\n");
+}
+
+static void
+run_legacy(const char *filename)
+{
+	legacy_free(legacy_parse(filename), 1);
+}
+
+static void
+run_stdio(const char *filename)
+{
+	free_tree(parse_stdio(filename));
+}
+
+static void
+run_mmap(const char *filename)
+{
+	free_tree(get_tree_from_file(filename));
+}
+
+static void
+run_stream(const char *filename)
+{
+	long blocks = 0;
+
+	tree_for_each_block(filename, count_block, &blocks);
+}
+
+static void
+run_nothing(const char *filename)
+{
+}
+
+/* the peak RSS of a child that runs step once, in KiB */
+static long
+child_peak_kb(void (*step)(const char *), const char *filename)
+{
+	struct rusage ru;
+	int status;
+	pid_t pid;
+
+	fflush(stdout);
+	pid = fork();
+	if (pid == -1){
+		perror("fork");
+		exit(1);
+	}
+	if (pid == 0){
+		step(filename);
+		_exit(0);
+	}
+	if (wait4(pid, &status, 0, &ru) == -1 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status) != 0){
+		fprintf(stderr, "%s: parse failed\n", filename);
+		exit(1);
+	}
+	return ru.ru_maxrss;
+}
+
+/*
+ * A child starts with whatever this process has resident, heap kept
+ * from earlier steps included, so that is taken off.
+ */
+static long
+peak_kb(void (*step)(const char *), const char *filename)
+{
+	long kb = child_peak_kb(step, filename) -
+		  child_peak_kb(run_nothing, filename);
+
+	return kb > 0 ? kb : 0;
+}
+
+/* writes the compiled image of filename to a temporary file */
+static char *
+compile(const char *filename)
+{
+	char *name = strdup("/tmp/tree-bench-XXXXXX");
+	struct tree_node *root;
+	int fd;
+
+	fd = mkstemp(name);
+	if (fd == -1){
+		perror("mkstemp");
+		exit(1);
+	}
+	close(fd);
+	root = get_tree_from_file(filename);
+	save_tree_image(root, name);
+	free_tree(root);
+	return name;
+}
+
+/*
+ * Not for chains: the legacy parser recurses once per level, with a
+ * 1 KiB buffer in each frame, and printing indents level i by i tabs.
+ */
+static void
+bench_file(const char *label, const char *filename, int reps, int shallow)
+{
+	struct stat st;
+	char *image;
+
+	if (stat(filename, &st) == -1){
+		perror(filename);
+		exit(1);
+	}
+	if (shallow)
+		report(label, st.st_size, "legacy", time_legacy(filename, reps),
+		       peak_kb(run_legacy, filename));
+	report(label, st.st_size, "stdio",
+	       time_parse(parse_stdio, filename, reps),
+	       peak_kb(run_stdio, filename));
+	report(label, st.st_size, "mmap",
+	       time_parse(get_tree_from_file, filename, reps),
+	       peak_kb(run_mmap, filename));
+	report(label, st.st_size, "stream", time_stream(filename, reps),
+	       peak_kb(run_stream, filename));
+	image = compile(filename);
+	report(label, st.st_size, "image",
+	       time_parse(get_tree_from_file, image, reps),
+	       peak_kb(run_mmap, image));
+	unlink(image);
+	free(image);
+	report(label, st.st_size, "dag", time_dag(filename, reps), -1);
+	report(label, st.st_size, "walk", time_walk(filename, reps, 0), -1);
+	report(label, st.st_size, "flat-walk", time_walk(filename, reps, 1),
+	       -1);
+	if (shallow){
+		report(label, st.st_size, "print",
+		       time_print(filename, reps, PRINT_STDIO), -1);
+		report(label, st.st_size, "print-fd",
+		       time_print(filename, reps, PRINT_FD), -1);
+		report(label, st.st_size, "flat-print",
+		       time_print(filename, reps, PRINT_FLAT), -1);
+	}
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+	long depth = 0, width = 0;
+	int opt, reps = 5;
+	char label[64], *name;
+
+	while ((opt = getopt(argc, argv, "r:D:W:")) != -1){
+		switch (opt){
+		case 'r':
+			reps = atoi(optarg);
+			if (reps <= 0)
+				usage();
+			break;
+		case 'D':
+			depth = atol(optarg);
+			if (depth <= 0)
+				usage();
+			break;
+		case 'W':
+			width = atol(optarg);
+			if (width <= 0)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind == argc && depth == 0 && width == 0)
+		usage();
+
+	printf("file,bytes,step,seconds,ms_per_mb,peak_kb\n");
+	for (int i = optind; i < argc; i++)
+		bench_file(argv[i], argv[i], reps, 1);
+	if (depth > 0){
+		name = generate("deep", depth);
+		snprintf(label, sizeof(label), "deep-%ld", depth);
+		bench_file(label, name, reps, 0);
+		unlink(name);
+		free(name);
+	}
+	if (width > 0){
+		name = generate("wide", width);
+		snprintf(label, sizeof(label), "wide-%ld", width);
+		bench_file(label, name, reps, 1);
+		unlink(name);
+		free(name);
+	}
+	return 0;
+}
@@ -0,0 +1,32 @@
+/*
+ * tree-compile.c
+ *
+ * Compiles a .tree file into an image that get_tree_from_file() maps
+ * as is, instead of parsing the text again in every run.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "tree.h"
+
+int main(int argc, char *argv[])
+{
+	struct tree_node *root;
+
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s <input_tree_file> <output_image>\n\n",
+			argv[0]);
+		exit(1);
+	}
+
+	root = get_tree_from_file(argv[1]);
+	if (root == NULL) {
+		fprintf(stderr, "%s: empty tree\n", argv[1]);
+		exit(1);
+	}
+	save_tree_image(root, argv[2]);
+	free_tree(root);
+
+	return 0;
+}
@@ -15,5 +15,6 @@ int main(int argc, char *argv[])
 	root = get_tree_from_file(argv[1]);
 	print_tree(root);
 
+	free_tree(root);
 	return 0;
 }
@@ -0,0 +1,264 @@
+/*
+ * tree-gen.c
+ *
+ * Generates a valid .tree file, in DFS order, of a chosen shape: the
+ * number of levels, the fan-out and how it is distributed, the length
+ * of the names and how many distinct names there are. Trees of tens of
+ * millions of nodes take seconds, and only the open path is kept in
+ * memory.
+ *
+ * The node limit is a budget that every node splits evenly among its
+ * children, so the tree stays balanced. Whatever a subtree leaves unused
+ * goes to the siblings after it, and a last child gets at least one
+ * child of its own while there is budget left, so random shapes do not
+ * die out before the limit.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <math.h>
+
+#define NAME_MAX_LEN 256
+#define OUT_BUFF_SIZE (1 << 20)
+
+enum dist { DIST_FIXED, DIST_UNIFORM, DIST_GEOMETRIC };
+
+struct gen {
+	unsigned long nodes;  /* at most, 0 for no limit */
+	unsigned long depth;  /* levels, 0 for no limit */
+	unsigned long width;
+	enum dist dist;
+	int name_len;
+	unsigned long names;  /* distinct names, 0 for all of them unique */
+	uint64_t seed, rng;
+	unsigned long next;   /* id of the next node to create */
+	unsigned long levels; /* deepest level so far */
+	FILE *file;
+};
+
+/* an emitted node whose children blocks are still to come */
+struct gen_frame {
+	unsigned long first, nr, next;
+	unsigned long level;
+	unsigned long extra; /* budget left for the children's descendants */
+	unsigned long mark;  /* g->next when the current child started */
+	int last;            /* no budget comes after this subtree's */
+};
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: ./tree-gen [-n nodes] [-d depth] [-w width] "
+			"[-f fixed|uniform|geometric]\n"
+			"                  [-l name_len] [-k names] [-s seed] "
+			"[-o file]\n"
+			"  -n nodes  at most this many nodes, spread evenly\n"
+			"  -d depth  levels of the tree, the root is level 1\n"
+			"  -w width  children of an inner node: exactly (fixed), "
+			"0..2*width (uniform)\n"
+			"            or width on average (geometric); default 2\n"
+			"  -l len    pad names to len characters\n"
+			"  -k names  draw names from this many distinct ones\n"
+			"at least one of -n and -d is needed\n");
+	exit(1);
+}
+
+/* xorshift64* */
+static uint64_t
+rng_next(struct gen *g)
+{
+	g->rng ^= g->rng >> 12;
+	g->rng ^= g->rng << 25;
+	g->rng ^= g->rng >> 27;
+	return g->rng * 2685821657736338717ULL;
+}
+
+/* splitmix64, so the name of a node depends on its id alone */
+static uint64_t
+mix(uint64_t x)
+{
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+/* children of a node with budget nodes for its subtree, itself included */
+static unsigned long
+fan_out(struct gen *g, unsigned long level, unsigned long budget, int last)
+{
+	unsigned long nr;
+	double u;
+
+	if ((g->depth && level >= g->depth) || budget <= 1)
+		return 0;
+	switch (g->dist){
+	case DIST_UNIFORM:
+		nr = rng_next(g) % (2 * g->width + 1);
+		break;
+	case DIST_GEOMETRIC:
+		/* P(k) = p (1 - p)^k, whose mean is width */
+		u = ((rng_next(g) >> 11) + 1) / 9007199254740993.0;
+		nr = floor(log(u) / log1p(-1.0 / (g->width + 1)));
+		break;
+	default:
+		nr = g->width;
+	}
+	if (nr == 0 && last)
+		nr = 1;
+	if (nr > budget - 1)
+		nr = budget - 1;
+	return nr;
+}
+
+/* the name of node id and a '\n': base 36, padded in front with '_' */
+static void
+put_name(struct gen *g, unsigned long id)
+{
+	static const char digits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+	char buff[NAME_MAX_LEN + 2], *p = buff + sizeof(buff);
+	uint64_t v = g->names ? mix(id ^ g->seed) % g->names : id;
+
+	*--p = '\n';
+	do {
+		*--p = digits[v % 36];
+		v /= 36;
+	} while (v > 0);
+	while (buff + sizeof(buff) - 1 - p < g->name_len)
+		*--p = '_';
+	fwrite(p, 1, buff + sizeof(buff) - p, g->file);
+}
+
+static void
+emit(struct gen *g, unsigned long id, unsigned long level,
+     unsigned long budget, int last, struct gen_frame *f)
+{
+	unsigned long i;
+
+	f->nr = fan_out(g, level, budget, last);
+	f->first = g->next;
+	f->next = 0;
+	f->level = level;
+	f->extra = budget - 1 - f->nr;
+	f->last = last;
+	g->next += f->nr;
+	if (level > g->levels)
+		g->levels = level;
+
+	put_name(g, id);
+	fprintf(g->file, "%lu\n", f->nr);
+	for (i = 0; i < f->nr; i++)
+		put_name(g, f->first + i);
+	fputc('\n', g->file);
+}
+
+static void
+generate(struct gen *g)
+{
+	struct gen_frame *stack, *top;
+	size_t depth = 0, cap = 64;
+	unsigned long left, budget;
+
+	stack = malloc(cap * sizeof(*stack));
+	if (stack == NULL){
+		perror("malloc");
+		exit(1);
+	}
+	g->next = 1;
+	emit(g, 0, 1, g->nodes ? g->nodes : ULONG_MAX, 1, &stack[depth++]);
+	while (depth > 0){
+		top = &stack[depth - 1];
+		if (top->next == top->nr){
+			depth--;
+			continue;
+		}
+		if (depth == cap){
+			cap *= 2;
+			stack = realloc(stack, cap * sizeof(*stack));
+			if (stack == NULL){
+				perror("realloc");
+				exit(1);
+			}
+			top = &stack[depth - 1];
+		}
+		/* settle what the previous child used, share out the rest */
+		if (top->next > 0)
+			top->extra -= g->next - top->mark;
+		top->mark = g->next;
+		left = top->nr - top->next;
+		budget = 1 + top->extra / left + (top->extra % left != 0);
+		emit(g, top->first + top->next, top->level + 1, budget,
+		     top->last && left == 1, &stack[depth]);
+		top->next++;
+		depth++;
+	}
+	free(stack);
+}
+
+int main(int argc, char *argv[])
+{
+	struct gen g = { .width = 2, .dist = DIST_FIXED, .seed = 1 };
+	const char *outfile = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:d:w:f:l:k:s:o:")) != -1){
+		switch (opt){
+		case 'n':
+			g.nodes = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			g.depth = strtoul(optarg, NULL, 10);
+			break;
+		case 'w':
+			g.width = strtoul(optarg, NULL, 10);
+			break;
+		case 'f':
+			if (!strcmp(optarg, "fixed"))
+				g.dist = DIST_FIXED;
+			else if (!strcmp(optarg, "uniform"))
+				g.dist = DIST_UNIFORM;
+			else if (!strcmp(optarg, "geometric"))
+				g.dist = DIST_GEOMETRIC;
+			else
+				usage();
+			break;
+		case 'l':
+			g.name_len = atoi(optarg);
+			if (g.name_len < 0 || g.name_len > NAME_MAX_LEN)
+				usage();
+			break;
+		case 'k':
+			g.names = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			g.seed = strtoull(optarg, NULL, 10);
+			break;
+		case 'o':
+			outfile = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc || (g.nodes == 0 && g.depth == 0))
+		usage();
+	g.rng = mix(g.seed) | 1;
+
+	g.file = outfile ? fopen(outfile, "w") : stdout;
+	if (g.file == NULL){
+		perror(outfile);
+		exit(1);
+	}
+	setvbuf(g.file, NULL, _IOFBF, OUT_BUFF_SIZE);
+	generate(&g);
+	if (fclose(g.file) == EOF){
+		perror(outfile ? outfile : "stdout");
+		exit(1);
+	}
+	fprintf(stderr, "%lu nodes, %lu levels\n", g.next, g.levels);
+	return 0;
+}
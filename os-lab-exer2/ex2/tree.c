@@ -3,82 +3,252 @@
 #include <unistd.h>
 #include <assert.h>
 #include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/prctl.h>
 #include <sys/wait.h>
 
 #include "tree.h"
 
 #define BUFF_SIZE 1024
+/* initial frames of the explicit DFS stacks */
+#define STACK_MIN 64
+
+/* doubles an explicit stack of frames of the given size */
+static void *
+grow_stack(void *stack, size_t *cap, size_t size)
+{
+	*cap = *cap ? *cap * 2 : STACK_MIN;
+	stack = realloc(stack, *cap * size);
+	if (stack == NULL){
+		fprintf(stderr, "stack allocation failed\n");
+		exit(1);
+	}
+	return stack;
+}
+
+/*
+ * print_tree() output is rendered into a large buffer and handed to
+ * stdio or write() in PRINT_BUFF_SIZE pieces; indentation is copied out
+ * of a string of tabs instead of being printed one tab at a time.
+ */
+#define PRINT_BUFF_SIZE (1 << 20)
+#define TABS_SIZE 256
+
+struct print_buff {
+	char *buff;
+	size_t used;
+	FILE *file; /* stdio sink, or else */
+	int fd;     /* write() sink */
+};
 
 static void
-__print_tree(struct tree_node *root, int level)
+print_flush(struct print_buff *pb)
 {
-	int i;
-	for (i=0; i<level; i++)
-		printf("\t");
-	printf("%s\n", root->name);
+	size_t done = 0;
+	ssize_t n;
 
-	for (i=0; i < root->nr_children; i++){
-		__print_tree(root->children + i, level + 1);
+	if (pb->file != NULL){
+		if (fwrite(pb->buff, 1, pb->used, pb->file) != pb->used){
+			perror("print_tree");
+			exit(1);
+		}
+		pb->used = 0;
+		return;
 	}
+	while (done < pb->used){
+		n = write(pb->fd, pb->buff + done, pb->used - done);
+		if (n == -1){
+			perror("print_tree");
+			exit(1);
+		}
+		done += n;
+	}
+	pb->used = 0;
+}
+
+static void
+print_put(struct print_buff *pb, const char *s, size_t len)
+{
+	size_t n;
+
+	while (len > 0){
+		if (pb->used == PRINT_BUFF_SIZE)
+			print_flush(pb);
+		n = PRINT_BUFF_SIZE - pb->used;
+		if (n > len)
+			n = len;
+		memcpy(pb->buff + pb->used, s, n);
+		pb->used += n;
+		s += n;
+		len -= n;
+	}
+}
+
+static void
+print_indent(struct print_buff *pb, size_t level)
+{
+	static char tabs[TABS_SIZE];
+	size_t n;
+
+	if (tabs[0] != '\t')
+		memset(tabs, '\t', TABS_SIZE);
+	for (; level > 0; level -= n){
+		n = level < TABS_SIZE ? level : TABS_SIZE;
+		print_put(pb, tabs, n);
+	}
+}
+
+static void
+print_begin(struct print_buff *pb)
+{
+	pb->buff = malloc(PRINT_BUFF_SIZE);
+	pb->used = 0;
+	if (pb->buff == NULL){
+		fprintf(stderr, "print buffer allocation failed\n");
+		exit(1);
+	}
+}
+
+static void
+print_end(struct print_buff *pb)
+{
+	print_flush(pb);
+	free(pb->buff);
+}
+
+/* a node on the walk down and the next of its children to visit */
+struct print_frame {
+	struct tree_node *node;
+	unsigned next;
+};
+
+/*
+ * A DFS with an explicit stack instead of recursion, so a chain of
+ * millions of levels needs memory, not call stack.
+ */
+static void
+__print_tree(struct tree_node *root, int level, struct print_buff *pb)
+{
+	struct print_frame *stack = NULL;
+	size_t depth = 0, cap = 0;
+	struct tree_node *node;
+	const char *name;
+
+	print_begin(pb);
+	for (node = root; node != NULL; ){
+		print_indent(pb, level + depth);
+		name = tree_node_name(node);
+		print_put(pb, name, strlen(name));
+		print_put(pb, "\n", 1);
+
+		if (depth == cap)
+			stack = grow_stack(stack, &cap, sizeof(*stack));
+		stack[depth].node = node;
+		stack[depth].next = 0;
+		depth++;
+
+		/* next: the first unvisited child of the deepest open node */
+		node = NULL;
+		while (depth > 0 && node == NULL){
+			struct print_frame *f = &stack[depth - 1];
+			if (f->next < f->node->nr_children)
+				node = tree_child(f->node, f->next++);
+			else
+				depth--;
+		}
+	}
+	print_end(pb);
+	free(stack);
 }
 
 void
 print_tree(struct tree_node *root)
 {
-	__print_tree(root, 0);
+	struct print_buff pb = { .file = stdout };
+
+	__print_tree(root, 0, &pb);
 }
 
-static char *
-read_line(FILE *file, char *buff, size_t buff_size)
+void
+print_tree_fd(struct tree_node *root, int fd)
 {
-	char *ret;
-	size_t ret_len;
+	struct print_buff pb = { .file = NULL, .fd = fd };
 
-	ret = fgets(buff, buff_size, file);
+	__print_tree(root, 0, &pb);
+}
 
-	/* sanity check */
-	if (ret == NULL){
-		return ret;
+/*
+ * Lines come either straight out of an mmap()ed file, where they are
+ * found with memchr() and never copied, or from a stdio stream through
+ * fgets(). A line is returned without its '\n' and is not NUL-terminated.
+ */
+struct line_reader {
+	const char *pos, *end; /* mapped backend */
+	FILE *file;            /* stdio backend, when not NULL */
+	char buff[BUFF_SIZE];
+};
+
+static const char *
+read_line(struct line_reader *lr, size_t *len)
+{
+	const char *ret, *nl;
+	size_t ret_len;
+
+	if (lr->file != NULL){
+		ret = fgets(lr->buff, BUFF_SIZE, lr->file);
+		/* sanity check */
+		if (ret == NULL){
+			return ret;
+		}
+		ret_len = strlen(ret);
+	} else {
+		if (lr->pos == lr->end)
+			return NULL;
+		ret = lr->pos;
+		nl = memchr(ret, '\n', lr->end - ret);
+		ret_len = (nl != NULL ? nl + 1 : lr->end) - ret;
+		lr->pos = ret + ret_len;
 	}
 
-	ret_len = strlen(ret);
-	if (ret_len == buff_size - 1){
-		fprintf(stderr, "line too long: %s\n", buff);
+	/* the same limit as the fgets() buffer, for the same errors */
+	if (ret_len >= BUFF_SIZE - 1){
+		fprintf(stderr, "line too long: %.*s\n", BUFF_SIZE - 1, ret);
 		exit(1);
 	}
 
-	if (ret_len > 0)
-		buff[ret_len - 1] = '\0'; /* remove \n */
-
+	*len = ret_len > 0 ? ret_len - 1 : 0; /* remove \n */
 	return ret;
 }
 
-static char *
-read_empty_line(FILE *file, char *buff, size_t buff_size)
+static const char *
+read_empty_line(struct line_reader *lr, size_t *len)
 {
-	char *ret;
-	ret = read_line(file, buff, buff_size);
-	if (ret != NULL && strlen(ret) != 0){
-		fprintf(stderr, "expecting an empty line: %s", buff);
+	const char *ret;
+	ret = read_line(lr, len);
+	if (ret != NULL && *len != 0){
+		fprintf(stderr, "expecting an empty line: %.*s", (int)*len, ret);
 		exit(1);
 	}
 
 	return ret;
 }
 
-static char *
-read_non_empty_line(FILE *file, char *buff, size_t buff_size)
+static const char *
+read_non_empty_line(struct line_reader *lr, size_t *len)
 {
-	char *ret;
-	ret = read_line(file, buff, buff_size);
+	const char *ret;
+	ret = read_line(lr, len);
 
 	if (ret == NULL){
 		fprintf(stderr, "unexpected EOF\n");
 		exit(1);
 	}
 
-	if (strlen(ret) == 0){
+	if (*len == 0){
 		fprintf(stderr, "Unexpected empty line\n");
 		exit(1);
 	}
@@ -86,15 +256,15 @@ read_non_empty_line(FILE *file, char *buff, size_t buff_size)
 	return ret;
 }
 
-static char *
-find_block_start(FILE *file, char *buff, size_t buff_size)
+static const char *
+find_block_start(struct line_reader *lr, size_t *len)
 {
-	char *line;
+	const char *line;
 	for (;;){
-		line = read_line(file, buff, buff_size);
+		line = read_line(lr, len);
 		if (line == NULL) /* EOF */
 			break;
-		if (strlen(line) == 0 || line[0] == '#')
+		if (*len == 0 || line[0] == '#')
 			continue;  /* comment or empty line */
 		else
 			break;
@@ -103,88 +273,1050 @@ find_block_start(FILE *file, char *buff, size_t buff_size)
 	return line;
 }
 
+/* atol() of a line that has no NUL */
+static long
+line_to_long(const char *s, size_t len)
+{
+	const char *end = s + len;
+	long v = 0;
+	int neg = 0;
+
+	while (s < end && isspace((unsigned char)*s))
+		s++;
+	if (s < end && (*s == '-' || *s == '+'))
+		neg = *s++ == '-';
+	while (s < end && isdigit((unsigned char)*s))
+		v = v * 10 + (*s++ - '0');
+	return neg ? -v : v;
+}
+
 /*
- * recursively parse tree file, creating nodes
+ * All the nodes of a tree live in one allocation, right after this
+ * header, and are followed by the string pool of their names. Children
+ * arrays are carved out in the order their parents appear in the file,
+ * which is a DFS order, so a walk over the tree moves forward through
+ * memory.
  */
-static struct tree_node *
-parse_node(FILE *file, struct tree_node *node)
+struct tree_arena {
+	char magic[8];     /* TREE_MAGIC */
+	uint64_t nr_nodes;
+	uint64_t size;     /* bytes of the allocation, header included */
+	uint32_t mapped;   /* 1 in a compiled image, released with munmap() */
+	uint32_t flags;
+};
+
+/* children arrays are shared and may come before their parents */
+#define ARENA_DAG 1
+
+/*
+ * A compiled image is the arena of a parsed tree written out as is: the
+ * children are offsets, so it works at whatever address it is mapped.
+ */
+#define TREE_MAGIC "TREEIMG2"
+
+/* the arena while it is being filled */
+struct tree_builder {
+	struct tree_arena *arena;
+	struct tree_node *nodes;
+	size_t cap;
+	/*
+	 * The arena moves when it grows, so children are recorded as the
+	 * index of their first node and turned into offsets at the end.
+	 */
+	size_t *first;
+	/*
+	 * Node names are offsets into the pool until the end, too. The
+	 * pool is indexed by an open addressing hash set of offset + 1,
+	 * where 0 is a free slot.
+	 */
+	char *pool;
+	size_t pool_used, pool_cap;
+	uint32_t *names;
+	size_t names_cap, nr_names;
+};
+
+#define ARENA_MIN_NODES 64
+#define POOL_MIN 4096
+#define NAMES_MIN 64
+/* parse_node() of the root, which has no node yet */
+#define NO_NODE ((size_t)-1)
+
+/* returns the index of nr new nodes, growing the arena as needed */
+static size_t
+alloc_nodes(struct tree_builder *b, size_t nr)
+{
+	size_t idx = b->cap ? b->arena->nr_nodes : 0, cap = b->cap;
+
+	/* offsets between nodes are 32-bit */
+	if (idx + nr > INT32_MAX){
+		fprintf(stderr, "allocate children failed\n");
+		exit(1);
+	}
+	while (idx + nr > cap)
+		cap = cap ? cap * 2 : ARENA_MIN_NODES;
+	if (cap != b->cap){
+		b->arena = realloc(b->arena, sizeof(struct tree_arena) +
+				   cap * sizeof(struct tree_node));
+		b->first = realloc(b->first, cap * sizeof(size_t));
+		if (b->arena == NULL || b->first == NULL){
+			fprintf(stderr, "allocate children failed\n");
+			exit(1);
+		}
+		b->nodes = (struct tree_node *)(b->arena + 1);
+		if (b->cap == 0){
+			memset(b->arena, 0, sizeof(struct tree_arena));
+			memcpy(b->arena->magic, TREE_MAGIC, sizeof(b->arena->magic));
+		}
+		b->cap = cap;
+	}
+	memset(b->nodes + idx, 0, nr * sizeof(struct tree_node));
+	b->arena->nr_nodes += nr;
+	return idx;
+}
+
+/* FNV-1a */
+static uint32_t
+hash_name(const char *name, size_t len)
+{
+	uint32_t h = 2166136261u;
+	size_t i;
+
+	for (i=0; i<len; i++){
+		h ^= (unsigned char)name[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/* whether the pool string at off is the line name of len bytes */
+static int
+pool_name_is(struct tree_builder *b, uint32_t off, const char *name,
+	     size_t len)
 {
-	char buff[BUFF_SIZE], *name, *num_str;
+	return strnlen(b->pool + off, len + 1) == len &&
+	       memcmp(b->pool + off, name, len) == 0;
+}
+
+static void
+grow_names(struct tree_builder *b)
+{
+	size_t cap = b->names_cap ? b->names_cap * 2 : NAMES_MIN;
+	uint32_t *names, off;
+	size_t i, j;
+
+	names = calloc(cap, sizeof(*names));
+	if (names == NULL){
+		fprintf(stderr, "name allocation failed\n");
+		exit(1);
+	}
+	for (i=0; i<b->names_cap; i++){
+		if (b->names[i] == 0)
+			continue;
+		off = b->names[i] - 1;
+		j = hash_name(b->pool + off, strlen(b->pool + off)) & (cap - 1);
+		while (names[j] != 0)
+			j = (j + 1) & (cap - 1);
+		names[j] = b->names[i];
+	}
+	free(b->names);
+	b->names = names;
+	b->names_cap = cap;
+}
+
+/* returns the pool offset of name, adding it if it is not there yet */
+static uint32_t
+intern_name(struct tree_builder *b, const char *name, size_t len)
+{
+	size_t i, mask, cap;
+	uint32_t off;
+
+	if (2 * (b->nr_names + 1) > b->names_cap)
+		grow_names(b);
+	mask = b->names_cap - 1;
+	for (i = hash_name(name, len) & mask; b->names[i] != 0;
+	     i = (i + 1) & mask){
+		off = b->names[i] - 1;
+		if (pool_name_is(b, off, name, len))
+			return off;
+	}
+
+	if (b->pool_used + len + 1 >= UINT32_MAX){
+		fprintf(stderr, "name allocation failed\n");
+		exit(1);
+	}
+	for (cap = b->pool_cap; b->pool_used + len + 1 > cap; )
+		cap = cap ? cap * 2 : POOL_MIN;
+	if (cap != b->pool_cap){
+		b->pool = realloc(b->pool, cap);
+		if (b->pool == NULL){
+			fprintf(stderr, "name allocation failed\n");
+			exit(1);
+		}
+		b->pool_cap = cap;
+	}
+	off = b->pool_used;
+	memcpy(b->pool + off, name, len);
+	b->pool[off + len] = '\0';
+	b->pool_used += len + 1;
+	b->names[i] = off + 1;
+	b->nr_names++;
+	return off;
+}
+
+/*
+ * parse the block of one node and allocate its children, whose blocks
+ * follow in DFS order; returns the index of the node
+ */
+static size_t
+parse_node(struct line_reader *lr, struct tree_builder *b, size_t idx)
+{
+	const char *name, *num_str;
+	struct tree_node *node;
 	unsigned nr_children;
+	size_t len, first;
 	int i;
 
-	name = find_block_start(file, buff, BUFF_SIZE);
+	name = find_block_start(lr, &len);
 	if (name == NULL){ /* EOF */
 		 /* empty file, do nothing */
-		if (node == NULL)
-			return NULL;
+		if (idx == NO_NODE)
+			return NO_NODE;
 		/* otherwise, terminate parsing */
-		fprintf(stderr, "expecting: %s and got EOF\n", node->name);
+		fprintf(stderr, "expecting: %s and got EOF\n",
+			b->pool + b->nodes[idx].name);
 		exit(1);
 	}
 
 	/* If no node given, allocate one -- this is used for root
 	 * If node is given, check that the names match */
-	if (node == NULL){
-		node = calloc(1, sizeof(struct tree_node));
-		if (node == NULL){
-			fprintf(stderr, "node allocation failed\n");
-			exit(1);
-		}
-		snprintf(node->name, NODE_NAME_SIZE, "%s", name);
-	} else if (strncmp(node->name, name, NODE_NAME_SIZE) != 0){
+	if (idx == NO_NODE){
+		idx = alloc_nodes(b, 1);
+		b->nodes[idx].name = intern_name(b, name, len);
+	} else if (!pool_name_is(b, b->nodes[idx].name, name, len)){
 		fprintf(stderr, "nodes must be placed in a DFS order\n");
-		fprintf(stderr, "expecting: %s and got: %s\n", node->name, name);
+		fprintf(stderr, "expecting: %s and got: %.*s\n",
+			b->pool + b->nodes[idx].name, (int)len, name);
 		exit(1);
 	}
+	node = &b->nodes[idx];
 
 	/* read number of children */
-	num_str = read_non_empty_line(file, buff, BUFF_SIZE);
-	nr_children = node->nr_children = atol(num_str);
+	num_str = read_non_empty_line(lr, &len);
+	nr_children = node->nr_children = line_to_long(num_str, len);
 
-	/* allocate children */
-	if (nr_children != 0){
-		node->children = malloc(sizeof(struct tree_node)*nr_children);
-		if (node->children == NULL){
-			fprintf(stderr, "allocate children failed\n");
-			exit(1);
-		}
-	}
+	/* allocate children, node is stale from here on */
+	first = alloc_nodes(b, nr_children);
+	b->first[idx] = first;
 
 	/* read children names */
 	for (i=0; i<nr_children; i++){
-		name = read_non_empty_line(file, buff, BUFF_SIZE);
-		snprintf(node->children[i].name, NODE_NAME_SIZE, "%s", name);
-		//printf("%s\n", node->children[i].name);
+		name = read_non_empty_line(lr, &len);
+		b->nodes[first + i].name = intern_name(b, name, len);
 	}
 
-	read_empty_line(file, buff, BUFF_SIZE);
+	read_empty_line(lr, &len);
 
-	/* parse children */
-	for (i=0; i<nr_children; i++){
-		parse_node(file, &node->children[i]);
+	return idx;
+}
+
+/* a parsed node whose children blocks are still to come */
+struct parse_frame {
+	size_t node;
+	unsigned next;
+};
+
+/*
+ * parse the tree file block by block, creating nodes; the children of
+ * the deepest open node come next, so an explicit stack of open nodes
+ * replaces the recursion
+ */
+static struct tree_node *
+parse_tree(struct line_reader *lr)
+{
+	struct tree_builder b = { NULL, NULL, 0, NULL, NULL, 0, 0, NULL, 0, 0 };
+	struct parse_frame *stack = NULL, *top;
+	size_t depth = 0, cap = 0, idx, i, nr;
+	struct tree_node *root;
+
+	idx = parse_node(lr, &b, NO_NODE);
+	if (idx == NO_NODE) /* empty file */
+		return NULL;
+	for (;;){
+		if (depth == cap)
+			stack = grow_stack(stack, &cap, sizeof(*stack));
+		stack[depth].node = idx;
+		stack[depth].next = 0;
+		depth++;
+
+		while (depth > 0){
+			top = &stack[depth - 1];
+			if (top->next < b.nodes[top->node].nr_children)
+				break;
+			depth--;
+		}
+		if (depth == 0)
+			break;
+		idx = b.first[top->node] + top->next++;
+		parse_node(lr, &b, idx);
+	}
+	free(stack);
+
+	/*
+	 * fit the arena to the nodes and the pool, then it stays put and
+	 * names can become offsets from their node, the root's the largest
+	 */
+	nr = b.arena->nr_nodes;
+	if (nr * sizeof(struct tree_node) + b.pool_used > UINT32_MAX){
+		fprintf(stderr, "node allocation failed\n");
+		exit(1);
+	}
+	b.arena->size = sizeof(struct tree_arena) +
+			nr * sizeof(struct tree_node) + b.pool_used;
+	b.arena = realloc(b.arena, b.arena->size);
+	if (b.arena == NULL){
+		fprintf(stderr, "node allocation failed\n");
+		exit(1);
 	}
+	root = (struct tree_node *)(b.arena + 1);
+	memcpy(root + nr, b.pool, b.pool_used);
+	for (i = 0; i < nr; i++){
+		root[i].children = root[i].nr_children ? b.first[i] - i : 0;
+		root[i].name += (nr - i) * sizeof(struct tree_node);
+	}
+	free(b.first);
+	free(b.pool);
+	free(b.names);
+
+	return root;
+}
+
+void
+free_tree(struct tree_node *root)
+{
+	struct tree_arena *arena;
+
+	if (root == NULL)
+		return;
+	arena = (struct tree_arena *)root - 1;
+	if (arena->mapped)
+		munmap(arena, arena->size);
+	else
+		free(arena);
+}
+
+void
+save_tree_image(struct tree_node *root, const char *filename)
+{
+	struct tree_arena *arena = (struct tree_arena *)root - 1;
+	struct tree_arena header;
+	FILE *file;
 
-	return node;
+	file = fopen(filename, "w");
+	if (file == NULL){
+		perror(filename);
+		exit(1);
+	}
+	header = *arena;
+	header.mapped = 1;
+	if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+	    fwrite(root, arena->size - sizeof(header), 1, file) != 1 ||
+	    fclose(file) == EOF){
+		perror(filename);
+		exit(1);
+	}
 }
 
+/* the root of a mapped compiled image, NULL if map is not one */
+static struct tree_node *
+image_root(void *map, size_t size, const char *filename)
+{
+	struct tree_arena *arena = map;
+
+	if (size < sizeof(*arena) ||
+	    memcmp(arena->magic, TREE_MAGIC, sizeof(arena->magic)) != 0)
+		return NULL;
+	/*
+	 * the nodes themselves are trusted, they come from save_tree_image(),
+	 * but no name may run off the end
+	 */
+	if (arena->size != size || arena->nr_nodes == 0 ||
+	    arena->nr_nodes > (size - sizeof(*arena)) / sizeof(struct tree_node) ||
+	    ((char *)map)[size - 1] != '\0'){
+		fprintf(stderr, "%s: corrupt tree image\n", filename);
+		exit(1);
+	}
+	return (struct tree_node *)(arena + 1);
+}
+
+struct tree_node *
+get_tree_from_stream(FILE *file)
+{
+	struct line_reader *lr;
+	struct tree_node *root;
+
+	lr = malloc(sizeof(*lr));
+	if (lr == NULL){
+		fprintf(stderr, "line reader allocation failed\n");
+		exit(1);
+	}
+	lr->file = file;
+	root = parse_tree(lr);
+	free(lr);
+
+	return root;
+}
 
 struct tree_node *
 get_tree_from_file(const char *filename)
 {
-	FILE *file;
-	assert(BUFF_SIZE >= NODE_NAME_SIZE);
+	struct line_reader *lr;
 	struct tree_node *root;
+	struct stat st;
+	void *map;
+	FILE *file;
+	int fd;
 
-	file = fopen(filename, "r");
-	if (file == NULL){
+	fd = open(filename, O_RDONLY);
+	if (fd == -1){
+		perror(filename);
+		exit(1);
+	}
+	if (fstat(fd, &st) == -1){
 		perror(filename);
 		exit(1);
 	}
 
-	root = parse_node(file, NULL);
+	/* pipes and the like cannot be mapped, read them the old way */
+	if (!S_ISREG(st.st_mode)){
+		file = fdopen(fd, "r");
+		if (file == NULL){
+			perror(filename);
+			exit(1);
+		}
+		root = get_tree_from_stream(file);
+		fclose(file);
+		return root;
+	}
 
-	fclose(file);
+	map = NULL;
+	if (st.st_size > 0){
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED){
+			perror(filename);
+			exit(1);
+		}
+		madvise(map, st.st_size, MADV_SEQUENTIAL);
+	}
+	close(fd);
+
+	/* a compiled image is used in place, and shared by every fork */
+	root = image_root(map, st.st_size, filename);
+	if (root != NULL)
+		return root;
+
+	lr = malloc(sizeof(*lr));
+	if (lr == NULL){
+		fprintf(stderr, "line reader allocation failed\n");
+		exit(1);
+	}
+	lr->file = NULL;
+	lr->pos = map;
+	lr->end = lr->pos + st.st_size;
+	root = parse_tree(lr);
+	free(lr);
+
+	if (map != NULL)
+		munmap(map, st.st_size);
 
 	return root;
 }
+
+/*
+ * The streaming parser keeps the whole text in memory, mapped or read in,
+ * so that its position is just an offset: a stream copied by fork() can
+ * be moved on to wherever another process got to.
+ */
+struct tree_stream {
+	struct line_reader lr;
+	const char *text;
+	size_t size;
+	int mapped;
+	/* NUL-terminated copies of the names of the current block */
+	char *names;
+	size_t names_cap;
+	size_t *offs;
+	char **children;
+	size_t children_cap;
+};
+
+/* the contents of a file that cannot be mapped */
+static char *
+slurp(FILE *file, size_t *size)
+{
+	size_t cap = BUFF_SIZE, n;
+	char *text = NULL;
+
+	*size = 0;
+	do {
+		if (text == NULL || *size == cap){
+			cap = text == NULL ? cap : cap * 2;
+			text = realloc(text, cap);
+			if (text == NULL){
+				fprintf(stderr, "stream allocation failed\n");
+				exit(1);
+			}
+		}
+		n = fread(text + *size, 1, cap - *size, file);
+		*size += n;
+	} while (n > 0);
+	if (ferror(file)){
+		perror("fread");
+		exit(1);
+	}
+	return text;
+}
+
+struct tree_stream *
+tree_stream_open(const char *filename)
+{
+	struct tree_stream *ts;
+	struct stat st;
+	FILE *file;
+	int fd;
+
+	ts = calloc(1, sizeof(*ts));
+	if (ts == NULL){
+		fprintf(stderr, "stream allocation failed\n");
+		exit(1);
+	}
+	fd = open(filename, O_RDONLY);
+	if (fd == -1 || fstat(fd, &st) == -1){
+		perror(filename);
+		exit(1);
+	}
+	if (S_ISREG(st.st_mode)){
+		ts->size = st.st_size;
+		if (ts->size > 0){
+			ts->text = mmap(NULL, ts->size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (ts->text == MAP_FAILED){
+				perror(filename);
+				exit(1);
+			}
+			madvise((void *)ts->text, ts->size, MADV_SEQUENTIAL);
+			ts->mapped = 1;
+		}
+		close(fd);
+	} else {
+		file = fdopen(fd, "r");
+		if (file == NULL){
+			perror(filename);
+			exit(1);
+		}
+		ts->text = slurp(file, &ts->size);
+		fclose(file);
+	}
+	if (ts->size >= sizeof(TREE_MAGIC) - 1 &&
+	    memcmp(ts->text, TREE_MAGIC, sizeof(TREE_MAGIC) - 1) == 0){
+		fprintf(stderr, "%s: a compiled image, not a tree file\n", filename);
+		exit(1);
+	}
+	ts->lr.file = NULL;
+	ts->lr.pos = ts->text;
+	ts->lr.end = ts->text + ts->size;
+	return ts;
+}
+
+void
+tree_stream_close(struct tree_stream *ts)
+{
+	if (ts->mapped)
+		munmap((void *)ts->text, ts->size);
+	else
+		free((void *)ts->text);
+	free(ts->names);
+	free(ts->offs);
+	free(ts->children);
+	free(ts);
+}
+
+long
+tree_stream_tell(struct tree_stream *ts)
+{
+	return ts->lr.pos - ts->text;
+}
+
+void
+tree_stream_seek(struct tree_stream *ts, long pos)
+{
+	assert(pos >= 0 && pos <= ts->size);
+	ts->lr.pos = ts->text + pos;
+}
+
+/* copies a line into the names of the block, returns its offset there */
+static size_t
+stash_name(struct tree_stream *ts, size_t *used, const char *name,
+	   size_t len)
+{
+	size_t off = *used;
+
+	while (off + len + 1 > ts->names_cap){
+		ts->names_cap = ts->names_cap ? ts->names_cap * 2 : BUFF_SIZE;
+		ts->names = realloc(ts->names, ts->names_cap);
+		if (ts->names == NULL){
+			fprintf(stderr, "stream allocation failed\n");
+			exit(1);
+		}
+	}
+	memcpy(ts->names + off, name, len);
+	ts->names[off + len] = '\0';
+	*used = off + len + 1;
+	return off;
+}
+
+int
+tree_stream_next(struct tree_stream *ts, struct tree_block *block)
+{
+	const char *line;
+	size_t len, used = 0, name;
+	unsigned i, nr;
+
+	line = find_block_start(&ts->lr, &len);
+	if (line == NULL) /* EOF */
+		return 0;
+	name = stash_name(ts, &used, line, len);
+
+	line = read_non_empty_line(&ts->lr, &len);
+	nr = line_to_long(line, len);
+	if (nr > ts->children_cap){
+		ts->children_cap = nr;
+		ts->offs = realloc(ts->offs, nr * sizeof(*ts->offs));
+		ts->children = realloc(ts->children, nr * sizeof(*ts->children));
+		if (ts->offs == NULL || ts->children == NULL){
+			fprintf(stderr, "allocate children failed\n");
+			exit(1);
+		}
+	}
+	for (i=0; i<nr; i++){
+		line = read_non_empty_line(&ts->lr, &len);
+		ts->offs[i] = stash_name(ts, &used, line, len);
+	}
+	read_empty_line(&ts->lr, &len);
+
+	/* the names have stopped moving */
+	block->name = ts->names + name;
+	block->nr_children = nr;
+	block->children = ts->children;
+	for (i=0; i<nr; i++)
+		ts->children[i] = ts->names + ts->offs[i];
+	return 1;
+}
+
+/* an open node of tree_for_each_block() and its children still to come */
+struct block_frame {
+	unsigned left;
+	size_t next; /* the name of the next one, in the name stack */
+	size_t base; /* where the names of this node start */
+};
+
+/*
+ * The DFS order check needs the children names of every open node, so
+ * they are kept on a stack of strings next to the stack of frames.
+ */
+int
+tree_for_each_block(const char *filename, tree_block_fn *fn, void *arg)
+{
+	struct block_frame *stack = NULL, *top;
+	size_t depth = 0, cap = 0, used = 0, names_cap = 0, len;
+	struct tree_stream *ts;
+	struct tree_block block;
+	char *names = NULL;
+	unsigned i;
+	int ret = 0;
+
+	ts = tree_stream_open(filename);
+	while (tree_stream_next(ts, &block)){
+		if (depth > 0){
+			top = &stack[depth - 1];
+			if (strcmp(names + top->next, block.name) != 0){
+				fprintf(stderr, "nodes must be placed in a DFS order\n");
+				fprintf(stderr, "expecting: %s and got: %s\n",
+					names + top->next, block.name);
+				exit(1);
+			}
+			top->next += strlen(names + top->next) + 1;
+			top->left--;
+		}
+
+		ret = fn(&block, depth, arg);
+		if (ret != 0)
+			break;
+
+		if (depth == cap)
+			stack = grow_stack(stack, &cap, sizeof(*stack));
+		stack[depth].left = block.nr_children;
+		stack[depth].next = stack[depth].base = used;
+		depth++;
+		for (i=0; i<block.nr_children; i++){
+			len = strlen(block.children[i]) + 1;
+			while (used + len > names_cap){
+				names_cap = names_cap ? names_cap * 2 : BUFF_SIZE;
+				names = realloc(names, names_cap);
+				if (names == NULL){
+					fprintf(stderr, "name allocation failed\n");
+					exit(1);
+				}
+			}
+			memcpy(names + used, block.children[i], len);
+			used += len;
+		}
+
+		/* close the nodes whose last child block this was */
+		while (depth > 0 && stack[depth - 1].left == 0)
+			used = stack[--depth].base;
+		if (depth == 0)
+			break;
+	}
+	if (ret == 0 && depth > 0){
+		fprintf(stderr, "expecting: %s and got EOF\n",
+			names + stack[depth - 1].next);
+		exit(1);
+	}
+	free(names);
+	free(stack);
+	tree_stream_close(ts);
+	return ret;
+}
+
+/*
+ * The flat tree keeps the arena order, so children are still contiguous
+ * and every parent comes before its children.
+ */
+static void *
+flat_alloc(size_t size)
+{
+	void *p = malloc(size ? size : 1);
+
+	if (p == NULL){
+		fprintf(stderr, "flat tree allocation failed\n");
+		exit(1);
+	}
+	return p;
+}
+
+struct flat_tree *
+flat_tree_from_nodes(struct tree_node *root)
+{
+	struct tree_arena *arena;
+	struct flat_tree *ft;
+	const char *pool;
+	uint32_t i, j, nr;
+
+	ft = flat_alloc(sizeof(*ft));
+	if (root == NULL){ /* empty file */
+		memset(ft, 0, sizeof(*ft));
+		return ft;
+	}
+	arena = (struct tree_arena *)root - 1;
+	if (arena->flags & ARENA_DAG){
+		fprintf(stderr, "a DAG has no flat tree\n");
+		exit(1);
+	}
+	nr = ft->nr_nodes = arena->nr_nodes;
+	pool = (const char *)(root + nr);
+	ft->names_size = arena->size - sizeof(*arena) -
+			 nr * sizeof(struct tree_node);
+	ft->nr_children = flat_alloc(nr * sizeof(*ft->nr_children));
+	ft->first_child = flat_alloc(nr * sizeof(*ft->first_child));
+	ft->name = flat_alloc(nr * sizeof(*ft->name));
+	ft->parent = flat_alloc(nr * sizeof(*ft->parent));
+	ft->names = flat_alloc(ft->names_size);
+	memcpy(ft->names, pool, ft->names_size);
+
+	ft->parent[0] = FLAT_NO_PARENT;
+	for (i=0; i<nr; i++){
+		ft->nr_children[i] = root[i].nr_children;
+		ft->first_child[i] = i + root[i].children;
+		ft->name[i] = tree_node_name(&root[i]) - pool;
+		for (j=0; j<root[i].nr_children; j++)
+			ft->parent[ft->first_child[i] + j] = i;
+	}
+	return ft;
+}
+
+struct tree_node *
+flat_tree_to_nodes(const struct flat_tree *ft)
+{
+	struct tree_arena *arena;
+	struct tree_node *root;
+	uint32_t i, nr = ft->nr_nodes;
+
+	if (nr == 0)
+		return NULL;
+	arena = flat_alloc(sizeof(*arena) + nr * sizeof(struct tree_node) +
+			   ft->names_size);
+	memset(arena, 0, sizeof(*arena));
+	memcpy(arena->magic, TREE_MAGIC, sizeof(arena->magic));
+	arena->nr_nodes = nr;
+	arena->size = sizeof(*arena) + nr * sizeof(struct tree_node) +
+		      ft->names_size;
+	root = (struct tree_node *)(arena + 1);
+	memcpy(root + nr, ft->names, ft->names_size);
+	for (i=0; i<nr; i++){
+		root[i].nr_children = ft->nr_children[i];
+		root[i].children = ft->nr_children[i] ? ft->first_child[i] - i : 0;
+		root[i].name = (nr - i) * sizeof(struct tree_node) + ft->name[i];
+	}
+	return root;
+}
+
+void
+free_flat_tree(struct flat_tree *ft)
+{
+	if (ft == NULL)
+		return;
+	free(ft->nr_children);
+	free(ft->first_child);
+	free(ft->name);
+	free(ft->parent);
+	free(ft->names);
+	free(ft);
+}
+
+/* one sweep over nr_children[], no walk at all */
+size_t
+flat_tree_count(const struct flat_tree *ft)
+{
+	size_t i, count = ft->nr_nodes ? 1 : 0;
+
+	for (i=0; i<ft->nr_nodes; i++)
+		count += ft->nr_children[i];
+	return count;
+}
+
+/* parents come first, so one forward sweep over parent[] */
+unsigned
+flat_tree_depth(const struct flat_tree *ft)
+{
+	unsigned *depth, max = 1;
+	size_t i;
+
+	if (ft->nr_nodes == 0)
+		return 0;
+	depth = flat_alloc(ft->nr_nodes * sizeof(*depth));
+	depth[0] = 1;
+	for (i=1; i<ft->nr_nodes; i++){
+		depth[i] = depth[ft->parent[i]] + 1;
+		if (depth[i] > max)
+			max = depth[i];
+	}
+	free(depth);
+	return max;
+}
+
+struct flat_frame {
+	uint32_t node;
+	unsigned next;
+};
+
+/* the output of print_tree(), with the same explicit stack DFS */
+void
+flat_print_tree(const struct flat_tree *ft)
+{
+	struct print_buff pb = { .file = stdout };
+	struct flat_frame *stack = NULL, *f;
+	size_t depth = 0, cap = 0;
+	const char *name;
+	uint32_t node;
+	int more;
+
+	if (ft->nr_nodes == 0)
+		return;
+	print_begin(&pb);
+	for (node = 0, more = 1; more; ){
+		print_indent(&pb, depth);
+		name = ft->names + ft->name[node];
+		print_put(&pb, name, strlen(name));
+		print_put(&pb, "\n", 1);
+
+		if (depth == cap)
+			stack = grow_stack(stack, &cap, sizeof(*stack));
+		stack[depth].node = node;
+		stack[depth].next = 0;
+		depth++;
+
+		for (more = 0; depth > 0 && !more; ){
+			f = &stack[depth - 1];
+			if (f->next < ft->nr_children[f->node]){
+				node = ft->first_child[f->node] + f->next++;
+				more = 1;
+			} else {
+				depth--;
+			}
+		}
+	}
+	print_end(&pb);
+	free(stack);
+}
+
+/*
+ * Hash-consing: a node is identified by its name and the identities of
+ * its children, in order. Names are interned, so a name is its pointer.
+ * Children come after their parents in the arena, so one backward sweep
+ * identifies every node after its children.
+ */
+struct dag_builder {
+	struct tree_node *root;
+	uint32_t *canon;    /* node -> its subtree's id */
+	uint32_t *example;  /* id -> a node with that subtree */
+	uint32_t *table;    /* hash set of id + 1, 0 is a free slot */
+	size_t mask;
+	uint32_t nr_ids;
+};
+
+static uint32_t
+subtree_hash(struct dag_builder *d, uint32_t i)
+{
+	struct tree_node *node = &d->root[i];
+	uint64_t h = (uintptr_t)tree_node_name(node) * 0x9e3779b97f4a7c15ULL;
+	uint32_t *kids = d->canon + i + node->children;
+	unsigned k;
+
+	h ^= node->nr_children;
+	for (k=0; k<node->nr_children; k++)
+		h = (h ^ kids[k]) * 0x100000001b3ULL;
+	return h ^ (h >> 32);
+}
+
+static int
+same_subtree(struct dag_builder *d, uint32_t i, uint32_t j)
+{
+	struct tree_node *a = &d->root[i], *b = &d->root[j];
+
+	return tree_node_name(a) == tree_node_name(b) &&
+	       a->nr_children == b->nr_children &&
+	       (a->nr_children == 0 ||
+		memcmp(d->canon + i + a->children, d->canon + j + b->children,
+		       a->nr_children * sizeof(uint32_t)) == 0);
+}
+
+static uint32_t
+intern_subtree(struct dag_builder *d, uint32_t i)
+{
+	size_t slot;
+	uint32_t id;
+
+	for (slot = subtree_hash(d, i) & d->mask; d->table[slot] != 0;
+	     slot = (slot + 1) & d->mask){
+		id = d->table[slot] - 1;
+		if (same_subtree(d, d->example[id], i))
+			return id;
+	}
+	id = d->nr_ids++;
+	d->example[id] = i;
+	d->table[slot] = id + 1;
+	return id;
+}
+
+struct tree_node *
+tree_to_dag(struct tree_node *root, struct dag_stats *stats)
+{
+	struct tree_arena *arena, *out;
+	uint32_t *array, *queue, *rec, nr, i, k, id, head = 0, tail = 0;
+	struct dag_builder d;
+	struct tree_node *dag, *ex;
+	size_t pool_size, size, out_nr = 1, cap;
+	const char *pool, *out_pool;
+
+	memset(stats, 0, sizeof(*stats));
+	if (root == NULL)
+		return NULL;
+	arena = (struct tree_arena *)root - 1;
+	if (arena->flags & ARENA_DAG){
+		fprintf(stderr, "tree_to_dag: already a DAG\n");
+		exit(1);
+	}
+	nr = arena->nr_nodes;
+	pool = (const char *)(root + nr);
+	pool_size = arena->size - sizeof(*arena) - nr * sizeof(struct tree_node);
+
+	for (cap = NAMES_MIN; cap < 2 * (size_t)nr; cap *= 2)
+		;
+	d.root = root;
+	d.canon = flat_alloc(nr * sizeof(uint32_t));
+	d.example = flat_alloc(nr * sizeof(uint32_t));
+	d.table = calloc(cap, sizeof(uint32_t));
+	if (d.table == NULL){
+		fprintf(stderr, "DAG allocation failed\n");
+		exit(1);
+	}
+	d.mask = cap - 1;
+	d.nr_ids = 0;
+	for (i = nr; i-- > 0; )
+		d.canon[i] = intern_subtree(&d, i);
+
+	/*
+	 * One children array per distinct inner subtree, placed breadth
+	 * first from the root as they are found; rec[] is the id each
+	 * record stands for, until its children offset is known.
+	 */
+	array = flat_alloc(d.nr_ids * sizeof(uint32_t));
+	queue = flat_alloc(d.nr_ids * sizeof(uint32_t));
+	for (id = 0; id < d.nr_ids; id++){
+		array[id] = UINT32_MAX;
+		ex = &root[d.example[id]];
+		if (ex->nr_children)
+			out_nr += ex->nr_children;
+	}
+	rec = flat_alloc(out_nr * sizeof(uint32_t));
+	rec[0] = d.canon[0];
+	out_nr = 1;
+	queue[tail++] = d.canon[0];
+	array[d.canon[0]] = 0;
+	while (head < tail){
+		id = queue[head++];
+		ex = &root[d.example[id]];
+		if (ex->nr_children == 0)
+			continue;
+		array[id] = out_nr;
+		for (k=0; k<ex->nr_children; k++){
+			rec[out_nr++] = d.canon[d.example[id] + ex->children + k];
+			if (array[rec[out_nr - 1]] == UINT32_MAX){
+				array[rec[out_nr - 1]] = 0; /* queued */
+				queue[tail++] = rec[out_nr - 1];
+			}
+		}
+	}
+
+	size = sizeof(*out) + out_nr * sizeof(struct tree_node) + pool_size;
+	out = flat_alloc(size);
+	memset(out, 0, sizeof(*out));
+	memcpy(out->magic, TREE_MAGIC, sizeof(out->magic));
+	out->nr_nodes = out_nr;
+	out->size = size;
+	out->flags = ARENA_DAG;
+	dag = (struct tree_node *)(out + 1);
+	out_pool = (const char *)(dag + out_nr);
+	memcpy((char *)out_pool, pool, pool_size);
+	for (i = 0; i < out_nr; i++){
+		ex = &root[d.example[rec[i]]];
+		dag[i].nr_children = ex->nr_children;
+		dag[i].children = ex->nr_children ?
+				  (int32_t)array[rec[i]] - (int32_t)i : 0;
+		dag[i].name = out_pool + (tree_node_name(ex) - pool) -
+			      (const char *)&dag[i];
+	}
+
+	stats->nodes = nr;
+	stats->stored = out_nr;
+	stats->subtrees = d.nr_ids;
+	stats->tree_bytes = arena->size;
+	stats->dag_bytes = size;
+
+	free(rec);
+	free(queue);
+	free(array);
+	free(d.table);
+	free(d.example);
+	free(d.canon);
+	return dag;
+}
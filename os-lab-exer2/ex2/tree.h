@@ -1,26 +1,151 @@
 #ifndef TREE_H
 #define TREE_H
 
+#include <stdio.h>
+#include <stdint.h>
+
 /******************************************************************************
  * Data structure definitions
  */
 
-#define NODE_NAME_SIZE 16
 /* tree node structure */
 struct tree_node {
 	unsigned          nr_children;
-	char              name[NODE_NAME_SIZE];
-	struct tree_node  *children;
+	uint32_t          name;     /* in bytes from this node, see below */
+	int32_t           children; /* first child, in nodes from this one */
 };
 
+/*
+ * The name of node. Names are interned: each distinct one is stored once
+ * per tree, in a string pool after the nodes.
+ */
+static inline const char *
+tree_node_name(const struct tree_node *node)
+{
+	return (const char *)node + node->name;
+}
+
+/* the i-th child of node */
+static inline struct tree_node *
+tree_child(struct tree_node *node, unsigned i)
+{
+	return node + node->children + i;
+}
+
 
 /******************************************************************************
  * Helper Functions
  */
 
-/* returns the root node of the tree defined in a file */
+/*
+ * returns the root node of the tree defined in a file, either text or a
+ * compiled image, which is mapped read-only instead of parsed
+ */
 struct tree_node *get_tree_from_file(const char *filename);
 
+/* the same, read from an open stream with fgets() instead of mmap() */
+struct tree_node *get_tree_from_stream(FILE *file);
+
 void print_tree(struct tree_node *root);
 
+/* the same, written straight to fd and bypassing stdio */
+void print_tree_fd(struct tree_node *root, int fd);
+
+/* releases a tree returned by get_tree_from_file(), in a single call */
+void free_tree(struct tree_node *root);
+
+/* writes the tree as a compiled image, for get_tree_from_file() to map */
+void save_tree_image(struct tree_node *root, const char *filename);
+
+
+/******************************************************************************
+ * DAG
+ *
+ * A tree with each set of structurally identical subtrees (same names,
+ * same shape) stored once: their nodes share one children array. The
+ * tree functions walk it as the full tree, print_tree() prints the same,
+ * and free_tree() and save_tree_image() take it, but it has no flat tree.
+ */
+
+struct dag_stats {
+	size_t            nodes;      /* in the tree */
+	size_t            stored;     /* nodes the DAG keeps for them */
+	size_t            subtrees;   /* distinct subtrees */
+	size_t            tree_bytes, dag_bytes;
+};
+
+/* a new DAG of a tree, which is left as it is */
+struct tree_node *tree_to_dag(struct tree_node *root, struct dag_stats *stats);
+
+/******************************************************************************
+ * Flat tree
+ *
+ * The same tree as parallel arrays indexed by node, root first, for
+ * whole-tree passes that sweep one field instead of walking nodes.
+ */
+
+#define FLAT_NO_PARENT UINT32_MAX
+
+struct flat_tree {
+	size_t            nr_nodes;
+	unsigned          *nr_children;
+	uint32_t          *first_child; /* index of the first, all contiguous */
+	uint32_t          *name;        /* offset into names */
+	uint32_t          *parent;      /* index, FLAT_NO_PARENT for the root */
+	char              *names;       /* the string pool of the tree */
+	size_t            names_size;
+};
+
+struct flat_tree *flat_tree_from_nodes(struct tree_node *root);
+
+/* a tree_node tree again, released with free_tree() */
+struct tree_node *flat_tree_to_nodes(const struct flat_tree *ft);
+
+void free_flat_tree(struct flat_tree *ft);
+
+/* the number of nodes and of levels, found from the arrays alone */
+size_t flat_tree_count(const struct flat_tree *ft);
+unsigned flat_tree_depth(const struct flat_tree *ft);
+
+/* the same output as print_tree() */
+void flat_print_tree(const struct flat_tree *ft);
+
+/******************************************************************************
+ * Streaming parser
+ *
+ * Reads a tree file one node block at a time and builds nothing, so the
+ * upper levels of a tree can be acted on while the rest is still unread.
+ */
+
+/* one node block, valid until the next one is read from the stream */
+struct tree_block {
+	const char        *name;
+	unsigned          nr_children;
+	char              **children; /* the names of the children, in order */
+};
+
+struct tree_stream;
+
+struct tree_stream *tree_stream_open(const char *filename);
+void tree_stream_close(struct tree_stream *ts);
+
+/* reads the next block, returns 0 at EOF; the DFS order is not checked */
+int tree_stream_next(struct tree_stream *ts, struct tree_block *block);
+
+/*
+ * The offset of the next block. A stream copied by fork() stays valid,
+ * so a process can seek to where another one stopped parsing.
+ */
+long tree_stream_tell(struct tree_stream *ts);
+void tree_stream_seek(struct tree_stream *ts, long pos);
+
+/*
+ * Calls fn for every block of the tree in DFS order, with the order
+ * checked and depth 0 for the root, until fn returns non-zero. Returns
+ * what fn returned last.
+ */
+typedef int tree_block_fn(const struct tree_block *block, unsigned depth,
+			  void *arg);
+int tree_for_each_block(const char *filename, tree_block_fn *fn, void *arg);
+
 #endif /* TREE_H */